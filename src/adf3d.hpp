@@ -0,0 +1,204 @@
+#ifndef __ADF3D_HPP__
+#define __ADF3D_HPP__
+
+#include <vector>
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include "trilinear.hpp"
+
+// Adaptively sampled distance field. The map is split into cubic bricks of 2^levels voxels
+// and each brick is an octree whose leaves store the trilinear parameters of its volume.
+// A cell is subdivided only if the trilinear interpolation of its corners does not fit the
+// dense samples inside it, so smooth regions far from the geometry use few large leaves.
+class Adf3d
+{
+public:
+
+	Adf3d(void)
+	{
+		m_levels = 5;
+		m_numBricks = 0;
+	}
+
+	//! Setup the brick layout for a dense grid of the given size. Bricks must be built next
+	void init(int sizeX, int sizeY, int sizeZ, float resolution, int levels, float tolerance, float relTolerance)
+	{
+		m_sizeX = sizeX;
+		m_sizeY = sizeY;
+		m_sizeZ = sizeZ;
+		m_resolution = resolution;
+		m_oneDivRes = 1.0/resolution;
+		m_levels = levels;
+		m_brickSize = 1 << levels;
+		m_tolerance = tolerance;
+		m_relTolerance = relTolerance;
+		m_numBricksX = (sizeX + m_brickSize - 1)/m_brickSize;
+		m_numBricksY = (sizeY + m_brickSize - 1)/m_brickSize;
+		m_numBricksZ = (sizeZ + m_brickSize - 1)/m_brickSize;
+		m_numBricks = m_numBricksX*m_numBricksY*m_numBricksZ;
+		m_bricks.assign(m_numBricks, 0);
+		m_brickNodes.assign(m_numBricks, std::vector<uint32_t>());
+		m_brickParams.assign(m_numBricks, std::vector<TrilinearParams>());
+		m_nodes.clear();
+		m_params.clear();
+	}
+
+	int getNumBricks(void)
+	{
+		return m_numBricks;
+	}
+
+	//! Build the octree of a brick. dist(ix, iy, iz) returns the dense distance sample of a voxel.
+	//! Different bricks can be built in parallel
+	template<typename Sampler>
+	void buildBrick(int b, Sampler &dist)
+	{
+		int bx = b % m_numBricksX;
+		int by = (b / m_numBricksX) % m_numBricksY;
+		int bz = b / (m_numBricksX*m_numBricksY);
+		m_bricks[b] = buildNode(b, bx*m_brickSize, by*m_brickSize, bz*m_brickSize, m_brickSize, dist);
+	}
+
+	//! Merge the bricks into the final contiguous arrays. Fails if there are too many cells for 31-bit indices
+	bool finish(void)
+	{
+		size_t numNodes = 0, numParams = 0;
+		for(int b=0; b<m_numBricks; b++)
+		{
+			numNodes += m_brickNodes[b].size();
+			numParams += m_brickParams[b].size();
+		}
+		if(numNodes >= LEAF || numParams >= LEAF)
+			return false;
+		m_nodes.reserve(numNodes);
+		m_params.reserve(numParams);
+		for(int b=0; b<m_numBricks; b++)
+		{
+			uint32_t nodeOffset = m_nodes.size(), paramOffset = m_params.size();
+			for(size_t i=0; i<m_brickNodes[b].size(); i++)
+				m_nodes.push_back(relocate(m_brickNodes[b][i], nodeOffset, paramOffset));
+			m_bricks[b] = relocate(m_bricks[b], nodeOffset, paramOffset);
+			m_params.insert(m_params.end(), m_brickParams[b].begin(), m_brickParams[b].end());
+			std::vector<uint32_t>().swap(m_brickNodes[b]);
+			std::vector<TrilinearParams>().swap(m_brickParams[b]);
+		}
+
+		return true;
+	}
+
+	//! Memory used by the field, in bytes
+	size_t getMemorySize(void)
+	{
+		return m_bricks.size()*sizeof(uint32_t) + m_nodes.size()*sizeof(uint32_t) + m_params.size()*sizeof(TrilinearParams);
+	}
+
+	size_t getNumLeaves(void)
+	{
+		return m_params.size();
+	}
+
+	//! Trilinear parameters of the leaf containing the point. The point must be into the map
+	inline const TrilinearParams &lookup(float x, float y, float z) const
+	{
+		int ix = std::min((int)(x*m_oneDivRes), m_sizeX-1);
+		int iy = std::min((int)(y*m_oneDivRes), m_sizeY-1);
+		int iz = std::min((int)(z*m_oneDivRes), m_sizeZ-1);
+		uint32_t node = m_bricks[(ix >> m_levels) + ((iy >> m_levels) + (iz >> m_levels)*m_numBricksY)*m_numBricksX];
+		for(int half = m_brickSize >> 1; !(node & LEAF); half >>= 1)
+			node = m_nodes[node + ((ix & half) ? 1 : 0) + ((iy & half) ? 2 : 0) + ((iz & half) ? 4 : 0)];
+		return m_params[node & ~LEAF];
+	}
+
+protected:
+
+	// Leaf flag into the node value. Leaves store the index of their parameters,
+	// inner nodes the index of their first child (the 8 children are contiguous)
+	static const uint32_t LEAF = 0x80000000;
+
+	static uint32_t relocate(uint32_t node, uint32_t nodeOffset, uint32_t paramOffset)
+	{
+		return (node & LEAF) ? (node + paramOffset) : (node + nodeOffset);
+	}
+
+	template<typename Sampler>
+	uint32_t buildNode(int b, int x0, int y0, int z0, int size, Sampler &dist)
+	{
+		// Corners are clamped to the grid, so cells crossing the border keep the border values
+		int x1 = x0 + size, y1 = y0 + size, z1 = z0 + size;
+		int cx1 = std::min(x1, m_sizeX-1), cy1 = std::min(y1, m_sizeY-1), cz1 = std::min(z1, m_sizeZ-1);
+		int cx0 = std::min(x0, m_sizeX-1), cy0 = std::min(y0, m_sizeY-1), cz0 = std::min(z0, m_sizeZ-1);
+		double c000 = dist(cx0, cy0, cz0), c001 = dist(cx0, cy0, cz1), c010 = dist(cx0, cy1, cz0), c011 = dist(cx0, cy1, cz1);
+		double c100 = dist(cx1, cy0, cz0), c101 = dist(cx1, cy0, cz1), c110 = dist(cx1, cy1, cz0), c111 = dist(cx1, cy1, cz1);
+
+		// Check the interpolation error against every dense sample into the cell
+		bool fits = true;
+		double oneDivSize = 1.0/size;
+		for(int iz=z0; iz<=z1 && fits && size > 1; iz++)
+		{
+			double w = (iz-z0)*oneDivSize;
+			for(int iy=y0; iy<=y1 && fits; iy++)
+			{
+				double v = (iy-y0)*oneDivSize;
+				double c00 = c000*(1-w) + c001*w, c01 = c010*(1-w) + c011*w;
+				double c10 = c100*(1-w) + c101*w, c11 = c110*(1-w) + c111*w;
+				double c0 = c00*(1-v) + c01*v, c1 = c10*(1-v) + c11*v;
+				for(int ix=x0; ix<=x1; ix++)
+				{
+					double u = (ix-x0)*oneDivSize;
+					double d = dist(std::min(ix, m_sizeX-1), std::min(iy, m_sizeY-1), std::min(iz, m_sizeZ-1));
+					if(fabs(c0*(1-u) + c1*u - d) > m_tolerance + m_relTolerance*fabs(d))
+					{
+						fits = false;
+						break;
+					}
+				}
+			}
+		}
+
+		// Leaf with the parameters of the whole cell in map coordinates
+		if(fits)
+		{
+			TrilinearParams p;
+			p.compute(c000, c001, c010, c011, c100, c101, c110, c111,
+					  x0*m_resolution, y0*m_resolution, z0*m_resolution,
+					  x1*m_resolution, y1*m_resolution, z1*m_resolution);
+			m_brickParams[b].push_back(p);
+			return (uint32_t)(m_brickParams[b].size()-1) | LEAF;
+		}
+
+		// Subdivide in 8 children, indexed by the x, y, z bits
+		int half = size/2;
+		uint32_t first = m_brickNodes[b].size();
+		m_brickNodes[b].resize(first + 8);
+		for(int c=0; c<8; c++)
+		{
+			uint32_t child = buildNode(b, x0 + ((c & 1) ? half : 0), y0 + ((c & 2) ? half : 0), z0 + ((c & 4) ? half : 0), half, dist);
+			m_brickNodes[b][first + c] = child;
+		}
+
+		return first;
+	}
+
+	// Dense grid layout
+	int m_sizeX, m_sizeY, m_sizeZ;
+	float m_resolution, m_oneDivRes;
+
+	// Bricks layout
+	int m_levels, m_brickSize;
+	int m_numBricksX, m_numBricksY, m_numBricksZ, m_numBricks;
+
+	// Subdivision tolerance: absolute plus relative to the sample value
+	float m_tolerance, m_relTolerance;
+
+	// Root node of each brick, octree nodes and leaf parameters
+	std::vector<uint32_t> m_bricks;
+	std::vector<uint32_t> m_nodes;
+	std::vector<TrilinearParams> m_params;
+
+	// Per brick nodes and parameters used while building
+	std::vector< std::vector<uint32_t> > m_brickNodes;
+	std::vector< std::vector<TrilinearParams> > m_brickParams;
+};
+
+#endif
@@ -3,10 +3,14 @@
 
 #include <vector>
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <message_filters/subscriber.h>
 #include <message_filters/time_synchronizer.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <sensor_msgs/point_cloud2_iterator.h>
+#include <sensor_msgs/Image.h>
+#include <sensor_msgs/CameraInfo.h>
+#include <sensor_msgs/image_encodings.h>
 #include <pcl_ros/transforms.h>
 #include <pcl/point_types.h>
 #include <tf/transform_broadcaster.h>
@@ -16,9 +20,14 @@
 #include <nav_msgs/Odometry.h>
 #include <sensor_msgs/Imu.h>
 #include <vector>
+#include <map>
+#include <boost/function.hpp>
+#include <algorithm>
 #include "grid3d.hpp"
 #include "dllsolver.hpp"
+#include "doublebuffer.hpp"
 #include <time.h>
+#include <string.h>
 
 using std::isnan;
 
@@ -35,6 +44,25 @@ public:
 		ros::NodeHandle lnh("~");
 		if(!lnh.getParam("in_cloud", m_inCloudTopic))
 			m_inCloudTopic = "/pointcloud";	
+		if(!lnh.getParam("in_clouds", m_inCloudTopics))
+			m_inCloudTopics.clear();
+		if(!lnh.getParam("sync_tolerance", m_syncTolerance))
+			m_syncTolerance = 0.05;
+		if(!lnh.getParam("in_depth", m_inDepthTopic))
+			m_inDepthTopic = "";
+		if(!lnh.getParam("in_depth_info", m_inDepthInfoTopic))
+			m_inDepthInfoTopic = m_inDepthTopic.substr(0, m_inDepthTopic.rfind('/') + 1) + "camera_info";
+		if(!lnh.getParam("depth_stride", m_depthStride))
+			m_depthStride = 4;
+		if(!lnh.getParam("depth_min_range", m_depthMinRange))
+			m_depthMinRange = 0.3;
+		if(!lnh.getParam("depth_max_range", m_depthMaxRange))
+			m_depthMaxRange = 10.0;
+		m_depthStride = std::max(1, m_depthStride);
+		if(!lnh.getParam("accumulate_frames", m_accumulateFrames))
+			m_accumulateFrames = 1;
+		if(!lnh.getParam("accumulate_rate", m_accumulateRate))
+			m_accumulateRate = 2.0;
 		if(!lnh.getParam("base_frame_id", m_baseFrameId))
 			m_baseFrameId = "base_link";	
 		if(!lnh.getParam("odom_frame_id", m_odomFrameId))
@@ -66,26 +94,136 @@ public:
             m_initZOffset = 0.0;  
 		if(!lnh.getParam("align_method", m_alignMethod))
             m_alignMethod = 1;
+		bool activeSet;
+		if(!lnh.getParam("solver_active_set", activeSet))
+			activeSet = false;
+		m_solver.setActiveSet(activeSet);
+		std::string solverType;
+		if(!lnh.getParam("solver_type", solverType))
+			solverType = "ceres";
+		m_solver.setNewton(solverType == "newton");
+		if(activeSet && solverType != "newton")
+			ROS_WARN("solver_active_set is only used by the newton solver");
+		bool mixedPrecision;
+		if(!lnh.getParam("solver_mixed_precision", mixedPrecision))
+			mixedPrecision = false;
+		m_solver.setMixedPrecision(mixedPrecision);
+		bool warmStart;
+		double resetDistance, resetAngle;
+		if(!lnh.getParam("solver_warm_start", warmStart))
+			warmStart = true;
+		if(!lnh.getParam("solver_reset_distance", resetDistance))
+			resetDistance = 1.0;
+		if(!lnh.getParam("solver_reset_angle", resetAngle))
+			resetAngle = 0.5;
+		m_solver.setWarmStart(warmStart, resetDistance, resetAngle);
+		bool adaptiveScale;
+		double lossScale, minScale, maxScale;
+		if(!lnh.getParam("solver_loss_scale", lossScale))
+			lossScale = 0.1;
+		m_solver.setLossScale(lossScale);
+		if(!lnh.getParam("solver_adaptive_scale", adaptiveScale))
+			adaptiveScale = false;
+		if(!lnh.getParam("solver_min_scale", minScale))
+			minScale = 0.01;
+		if(!lnh.getParam("solver_max_scale", maxScale))
+			maxScale = 1.0;
+		m_solver.setAdaptiveScale(adaptiveScale, minScale, maxScale);
+		if(!lnh.getParam("solver_benchmark", m_solverBenchmark))
+			m_solverBenchmark = false;
+		if(!lnh.getParam("sort_points", m_sortPoints))
+			m_sortPoints = true;
+		if(!lnh.getParam("publish_odometry", m_publishOdometry))
+			m_publishOdometry = false;
+		if(!lnh.getParam("odom_topic", m_odomTopic))
+			m_odomTopic = "odom";
+		if(!lnh.getParam("publish_aligned_cloud", m_publishAligned))
+			m_publishAligned = true;
+		if(!lnh.getParam("initial_pose_search", m_poseSearch))
+			m_poseSearch = true;
+		if(!lnh.getParam("initial_pose_search_xy", m_poseSearchXY))
+			m_poseSearchXY = 1.0;
+		if(!lnh.getParam("initial_pose_search_yaw", m_poseSearchYaw))
+			m_poseSearchYaw = 0.6;
+		if(!lnh.getParam("initial_pose_search_points", m_poseSearchPoints))
+			m_poseSearchPoints = 300;
+		std::string mapPath, descriptorsPath;
+		if(!lnh.getParam("map_path", mapPath))
+			mapPath = "map.ot";
+		if(!lnh.getParam("descriptors_path", descriptorsPath))
+			descriptorsPath = mapPath.substr(0, mapPath.find_last_of('.')) + ".scd";
+		if(!lnh.getParam("place_recognition", m_placeRecognition))
+			m_placeRecognition = true;
+		if(!lnh.getParam("place_recognition_candidates", m_recognitionCandidates))
+			m_recognitionCandidates = 5;
+		bool planar;
+		double planarMinZ, planarMaxZ;
+		if(!lnh.getParam("planar", planar))
+			planar = false;
+		if(!lnh.getParam("planar_min_z", planarMinZ))
+			planarMinZ = 0.0;
+		if(!lnh.getParam("planar_max_z", planarMaxZ))
+			planarMaxZ = 3.0;
+		m_solver.setPlanar(planar);
 		
 		// Init internal variables
 		m_init = false;
 		m_doUpdate = false;
-		m_tfCache = false;
+		m_poseSearchPending = false;
+		m_frames.resize(std::max(1, m_accumulateFrames));
+		m_depthStep = 0;
+		m_frameHead = 0;
+		m_frameCount = 0;
+		m_lastSweep = ros::Time(0);
 		
 		// Compute trilinear interpolation map 
 		m_grid3d.computeTrilinearInterpolation(); //三线性插值, m_triGrid
 
+		// Keep only the height band swept by the sensor for planar robots
+		if(planar && !m_grid3d.setupPlanarField(planarMinZ, planarMaxZ))
+			ROS_WARN("Empty planar_min_z/planar_max_z band, using the full field");
+
 		// Launch subscribers
-		m_pcSub = m_nh.subscribe(m_inCloudTopic, 1, &DLLNode::pointcloudCallback, this);
+		if(!m_inDepthTopic.empty())
+		{
+			m_depthInfoSub = m_nh.subscribe(m_inDepthInfoTopic, 1, &DLLNode::depthInfoCallback, this);
+			m_depthSub = m_nh.subscribe(m_inDepthTopic, m_frames.size(), &DLLNode::depthCallback, this);
+		}
+		else if(m_inCloudTopics.empty())
+			m_pcSub = m_nh.subscribe(m_inCloudTopic, m_frames.size(), &DLLNode::pointcloudCallback, this);
+		else
+		{
+			m_cloudSlots.resize(m_inCloudTopics.size());
+			for(size_t i=0; i<m_inCloudTopics.size(); i++)
+			{
+				boost::function<void(const sensor_msgs::PointCloud2ConstPtr&)> callback = 
+					[this, i](const sensor_msgs::PointCloud2ConstPtr& cloud) { multiCloudCallback(cloud, i); };
+				m_pcSubs.push_back(m_nh.subscribe<sensor_msgs::PointCloud2>(m_inCloudTopics[i], 1, callback));
+			}
+		}
 		m_initialPoseSub = lnh.subscribe("initial_pose", 2, &DLLNode::initialPoseReceived, this);
 		if(m_use_imu)
 			m_imuSub = m_nh.subscribe("imu", 1, &DLLNode::imuCallback, this);
 
-		// Time stamp for periodic update
-		m_lastPeriodicUpdate = ros::Time::now();
+		// Launch publishers
+		if(m_publishAligned)
+			m_alignedPub = m_nh.advertise<sensor_msgs::PointCloud2>(node_name+"/aligned_cloud", 1);
+
+		// Map poses at the odometry rate, served from their own thread so solving never delays them
+		if(m_publishOdometry)
+		{
+			m_odomPub = m_nh.advertise<nav_msgs::Odometry>(node_name+"/odometry", 10);
+			m_odomNh.setCallbackQueue(&m_odomQueue);
+			m_odomSub = m_odomNh.subscribe(m_odomTopic, 10, &DLLNode::odomCallback, this);
+			m_odomSpinner.reset(new ros::AsyncSpinner(1, &m_odomQueue));
+			m_odomSpinner->start();
+		}
 
-		// Launch updater timer
-		updateTimer = m_nh.createTimer(ros::Duration(1.0/m_updateRate), &DLLNode::checkUpdateThresholdsTimer, this);
+		// Time stamp for periodic update, compared with the scan stamps
+		m_lastPeriodicUpdate = ros::Time(0);
+
+		// Launch TF publication timer. Updates are triggered by the scans themselves
+		m_tfTimer = m_nh.createTimer(ros::Duration(1.0/m_updateRate), &DLLNode::publishTfTimer, this);
 		
 		// Initialize TF from odom to map as identity
 		m_lastGlobalTf.setIdentity();
@@ -103,30 +241,45 @@ public:
 			setInitialPose(pose);
 			m_init = true;
 		}
+
+		// Without initial pose, localize from the place recognition descriptors if they are available
+		m_recognitionPending = false;
+		if(!m_init && m_placeRecognition)
+		{
+			if(m_descriptors.load(descriptorsPath))
+			{
+				ROS_INFO("Loaded %d place recognition descriptors from %s", (int)m_descriptors.size(), descriptorsPath.c_str());
+				m_recognitionPending = m_descriptors.size() > 0;
+				m_lastRecognition = ros::Time(0);
+			}
+			else
+				ROS_WARN("No place recognition descriptors in %s, waiting for an initial pose", descriptorsPath.c_str());
+		}
 	}
 
 	//!Default destructor
 	~DLLNode()
 	{
+		if(m_odomSpinner)
+			m_odomSpinner->stop();
 	}
 		
-	//! Check motion and time thresholds for AMCL update
-	bool checkUpdateThresholds()
+	//! Check motion and time thresholds for AMCL update, at the time of the scan
+	bool checkUpdateThresholds(const ros::Time &t)
 	{
 		// If the filter is not initialized then exit
 		if(!m_init)
 			return false;
-					
-		// Publish current TF from odom to map
-		m_tfBr.sendTransform(tf::StampedTransform(m_lastGlobalTf, ros::Time::now(), m_globalFrameId, m_odomFrameId));
 		
-		// Compute odometric translation and rotation since last update 
-		ros::Time t = ros::Time::now();
+		// Compute odometric translation and rotation since last update, with the latest odometry
+		// if it does not reach the scan yet
 		tf::StampedTransform odomTf;
 		try
 		{
-			m_tfListener.waitForTransform(m_odomFrameId, m_baseFrameId, ros::Time(0), ros::Duration(.0));
-			m_tfListener.lookupTransform(m_odomFrameId, m_baseFrameId, ros::Time(0), odomTf);
+			if(m_tfListener.waitForTransform(m_odomFrameId, m_baseFrameId, t, ros::Duration(.0)))
+				m_tfListener.lookupTransform(m_odomFrameId, m_baseFrameId, t, odomTf);
+			else
+				m_tfListener.lookupTransform(m_odomFrameId, m_baseFrameId, ros::Time(0), odomTf);
 		}
 		catch (tf::TransformException ex)
 		{
@@ -167,11 +320,19 @@ public:
 		return false;
 	}
 		                                   
+	//! Publish the current TF from odom to map
+	void publishTf(void)
+	{
+		m_tfBr.sendTransform(tf::StampedTransform(m_lastGlobalTf, ros::Time::now(), m_globalFrameId, m_odomFrameId));
+	}
+
 private:
 
-	void checkUpdateThresholdsTimer(const ros::TimerEvent& event)
+	//! Periodic TF republication, so that the map frame stays available between updates
+	void publishTfTimer(const ros::TimerEvent& event)
 	{
-		checkUpdateThresholds();
+		if(m_init)
+			publishTf();
 	}
 
 	void initialPoseReceived(const geometry_msgs::PoseWithCovarianceStampedConstPtr& msg)
@@ -192,8 +353,47 @@ private:
 		
 		// Initialize the filter
 		setInitialPose(pose);
+
+		// Refine the pose with a correlative search on the next scan, operator poses are coarse
+		if(m_init && m_poseSearch)
+		{
+			m_poseSearchPending = true;
+			m_doUpdate = true;
+		}
 	}
 	
+	//! Odometry callback, in the odometry thread: composes the latest correction with the odometry
+	void odomCallback(const nav_msgs::OdometryConstPtr& msg)
+	{
+		GlobalTfData data;
+		if(!m_globalTfBuffer.read(data))
+			return;
+		tf::Transform globalTf(tf::Quaternion(data.qx, data.qy, data.qz, data.qw), tf::Vector3(data.x, data.y, data.z));
+		if(msg->header.frame_id != m_odomFrameId)
+			ROS_WARN_ONCE("Odometry in frame \"%s\" instead of \"%s\"", msg->header.frame_id.c_str(), m_odomFrameId.c_str());
+
+		// The twist is given in the child frame, so it does not change
+		tf::Pose odomPose;
+		tf::poseMsgToTF(msg->pose.pose, odomPose);
+		m_odomMsg.header.stamp = msg->header.stamp;
+		m_odomMsg.header.frame_id = m_globalFrameId;
+		m_odomMsg.child_frame_id = msg->child_frame_id.empty() ? m_baseFrameId : msg->child_frame_id;
+		tf::poseTFToMsg(globalTf*odomPose, m_odomMsg.pose.pose);
+		m_odomMsg.twist = msg->twist;
+		m_odomPub.publish(m_odomMsg);
+	}
+
+	//! Update the odom to map correction, also for the odometry thread
+	void setGlobalTf(const tf::Transform &globalTf)
+	{
+		m_lastGlobalTf = globalTf;
+		const tf::Vector3 &t = globalTf.getOrigin();
+		tf::Quaternion q = globalTf.getRotation();
+		GlobalTfData data = {t.x(), t.y(), t.z(), q.x(), q.y(), q.z(), q.w()};
+		m_globalTfBuffer.write(data);
+		publishTf();
+	}
+
 	//! IMU callback
 	void imuCallback(const sensor_msgs::Imu::ConstPtr& msg) 
 	{
@@ -216,51 +416,293 @@ private:
 	//! 3D point-cloud callback
 	void pointcloudCallback(const sensor_msgs::PointCloud2ConstPtr& cloud)
 	{		
-		// If the filter is not initialized then exit
-		if(!m_init)
+		// Every frame is needed when accumulating
+		if(m_accumulateFrames <= 1 && !acceptScan(cloud->header.stamp))
 			return;
-			
-		// Check if an update must be performed or not
-		if(!m_doUpdate)
+		m_scan.clear();
+		if(appendCloud(*cloud))
+			scanReceived(cloud->header.stamp);
+	}
+
+	//! Callback of the index-th cloud topic with several lidars. The clouds are merged once there is
+	//! one of each topic within sync_tolerance seconds
+	void multiCloudCallback(const sensor_msgs::PointCloud2ConstPtr& cloud, int index)
+	{
+		m_cloudSlots[index] = cloud;
+
+		// Approximate time synchronization: drop the clouds too old to match the newest one,
+		// which can be the cloud just received if it arrived late
+		ros::Time newest = cloud->header.stamp;
+		for(size_t i=0; i<m_cloudSlots.size(); i++)
+			if(m_cloudSlots[i] && m_cloudSlots[i]->header.stamp > newest)
+				newest = m_cloudSlots[i]->header.stamp;
+		bool complete = true;
+		for(size_t i=0; i<m_cloudSlots.size(); i++)
+		{
+			if(m_cloudSlots[i] && (newest - m_cloudSlots[i]->header.stamp).toSec() > m_syncTolerance)
+				m_cloudSlots[i].reset();
+			complete &= (bool)m_cloudSlots[i];
+		}
+		if(!complete)
 			return;
 
-		// Compute odometric translation and rotation since last update 
+		// Merge all the clouds into the scan buffer
+		bool ok = m_accumulateFrames > 1 || acceptScan(newest);
+		m_scan.clear();
+		for(size_t i=0; i<m_cloudSlots.size() && ok; i++)
+			ok = appendCloud(*m_cloudSlots[i]);
+		for(size_t i=0; i<m_cloudSlots.size(); i++)
+			m_cloudSlots[i].reset();
+		if(ok)
+			scanReceived(newest);
+	}
+
+	//! Camera intrinsics of the depth images. The ray tables are rebuilt only if they change
+	void depthInfoCallback(const sensor_msgs::CameraInfoConstPtr& info)
+	{
+		if(info->width == m_depthInfo.width && info->height == m_depthInfo.height && info->K == m_depthInfo.K)
+			return;
+		m_depthInfo = *info;
+		m_depthRays.clear();
+	}
+
+	//! Callback of the depth images: the strided pixels are back-projected with the ray tables 
+	//! directly into the scan buffer
+	void depthCallback(const sensor_msgs::ImageConstPtr& image)
+	{
+		if(m_depthInfo.width == 0)
+		{
+			ROS_WARN_THROTTLE(5.0, "Waiting for the camera info of %s", m_inDepthTopic.c_str());
+			return;
+		}
+		if(image->width != m_depthInfo.width || image->height != m_depthInfo.height)
+		{
+			ROS_WARN_THROTTLE(5.0, "Depth image size does not match its camera info");
+			return;
+		}
+		float scale;
+		if(image->encoding == sensor_msgs::image_encodings::TYPE_16UC1 || image->encoding == sensor_msgs::image_encodings::MONO16)
+			scale = 0.001;
+		else if(image->encoding == sensor_msgs::image_encodings::TYPE_32FC1)
+			scale = 1.0;
+		else
+		{
+			ROS_ERROR_THROTTLE(5.0, "Unsupported depth encoding %s", image->encoding.c_str());
+			return;
+		}
+		if(m_accumulateFrames <= 1 && !acceptScan(image->header.stamp))
+			return;
+		if((m_depthRays.empty() || image->step != m_depthStep || image->header.frame_id != m_depthFrameId) && !setupDepthRays(*image))
+			return;
+
+		// Back-project the sampled pixels into the base frame
+		const uint8_t *data = &image->data[0];
+		const tf::Vector3 &t = m_sensorTfs[m_depthFrameId].getOrigin();
+		float tx = t.x(), ty = t.y(), tz = t.z();
+		float minD = m_depthMinRange, maxD = m_depthMaxRange;
+		bool isFloat = scale == 1.0;
+		m_scan.clear();
+		m_scan.reserve(m_depthOffsets.size());
+		for(size_t i=0; i<m_depthOffsets.size(); i++)
+		{
+			float d;
+			if(isFloat)
+				memcpy(&d, data + m_depthOffsets[i], sizeof(float));
+			else
+			{
+				uint16_t raw;
+				memcpy(&raw, data + m_depthOffsets[i], sizeof(uint16_t));
+				d = raw*scale;
+			}
+			if(!(d >= minD && d <= maxD))  // Also rejects NaN and zero (no return)
+				continue;
+			const float *ray = &m_depthRays[3*i];
+			m_scan.push_back(pcl::PointXYZ(d*ray[0] + tx, d*ray[1] + ty, d*ray[2] + tz));
+		}
+		scanReceived(image->header.stamp);
+	}
+
+	//! Precompute the byte offset and the ray in the base frame (for unit depth) of each sampled pixel
+	bool setupDepthRays(const sensor_msgs::Image &image)
+	{
+		tf::StampedTransform sensorTf;
+		if(!getSensorTf(image.header.frame_id, sensorTf))
+			return false;
+		const tf::Matrix3x3 &R = sensorTf.getBasis();
+		float fx = m_depthInfo.K[0], fy = m_depthInfo.K[4], cx = m_depthInfo.K[2], cy = m_depthInfo.K[5];
+		int bytes = image.encoding == sensor_msgs::image_encodings::TYPE_32FC1 ? sizeof(float) : sizeof(uint16_t);
+		m_depthOffsets.clear();
+		m_depthRays.clear();
+		for(int v=m_depthStride/2; v<(int)image.height; v+=m_depthStride)
+		{
+			for(int u=m_depthStride/2; u<(int)image.width; u+=m_depthStride)
+			{
+				// Optical frame ray: z forward, x right, y down
+				tf::Vector3 ray = R*tf::Vector3((u-cx)/fx, (v-cy)/fy, 1.0);
+				m_depthOffsets.push_back((size_t)v*image.step + u*bytes);
+				m_depthRays.push_back(ray.x());
+				m_depthRays.push_back(ray.y());
+				m_depthRays.push_back(ray.z());
+			}
+		}
+		m_depthStep = image.step;
+		m_depthFrameId = image.header.frame_id;
+		ROS_INFO("Depth input: %d of %d pixels used", (int)m_depthOffsets.size(), image.width*image.height);
+
+		return true;
+	}
+
+	//! Register the scan buffer, directly or once accumulated
+	void scanReceived(const ros::Time &stamp)
+	{
+		if(m_accumulateFrames <= 1)
+			processScan(stamp);
+		else
+			accumulateScan(stamp);
+	}
+
+	//! Store the scan buffer into the ring of frames, and register the motion compensated sweep 
+	//! of the last frames at most at accumulate_rate
+	void accumulateScan(const ros::Time &stamp)
+	{
+		// Odometry at the frame stamp, or the latest one if it is not available yet
 		tf::StampedTransform odomTf;
 		try
 		{
-			m_tfListener.waitForTransform(m_odomFrameId, m_baseFrameId, ros::Time(0), ros::Duration(1.0));
-			m_tfListener.lookupTransform(m_odomFrameId, m_baseFrameId, ros::Time(0), odomTf); //latest时刻，odom2base
+			if(m_tfListener.waitForTransform(m_odomFrameId, m_baseFrameId, stamp, ros::Duration(0.05)))
+				m_tfListener.lookupTransform(m_odomFrameId, m_baseFrameId, stamp, odomTf);
+			else
+				m_tfListener.lookupTransform(m_odomFrameId, m_baseFrameId, ros::Time(0), odomTf);
 		}
 		catch (tf::TransformException ex)
 		{
 			ROS_ERROR("%s",ex.what());
 			return;
 		}
-		tf::Transform mapTf;
-		mapTf = m_lastGlobalTf * odomTf; //mapTf： latest时刻，map2base初值
 
-		// Pre-cache transform for point-cloud to base frame and transform the pc
-		if(!m_tfCache)
+		// Swap the buffers, so that the slots keep their memory
+		ScanFrame &frame = m_frames[m_frameHead];
+		frame.points.swap(m_scan);
+		frame.odom = odomTf;
+		m_frameHead = (m_frameHead + 1) % m_frames.size();
+		m_frameCount = std::min(m_frameCount + 1, (int)m_frames.size());
+		if(m_frameCount < (int)m_frames.size() || (stamp - m_lastSweep).toSec() < 1.0/m_accumulateRate || !acceptScan(stamp))
+			return;
+
+		// Sweep in the base frame of the newest frame
+		tf::Transform newestInv = odomTf.inverse();
+		m_scan.clear();
+		for(size_t k=0; k<m_frames.size(); k++)
+		{
+			tf::Transform T = newestInv*m_frames[k].odom;
+			const tf::Matrix3x3 &R = T.getBasis();
+			const tf::Vector3 &t = T.getOrigin();
+			float r00 = R[0][0], r01 = R[0][1], r02 = R[0][2], tx = t.x();
+			float r10 = R[1][0], r11 = R[1][1], r12 = R[1][2], ty = t.y();
+			float r20 = R[2][0], r21 = R[2][1], r22 = R[2][2], tz = t.z();
+			const std::vector<pcl::PointXYZ> &points = m_frames[k].points;
+			for(size_t i=0; i<points.size(); i++)
+			{
+				float x = points[i].x, y = points[i].y, z = points[i].z;
+				m_scan.push_back(pcl::PointXYZ(x*r00 + y*r01 + z*r02 + tx, x*r10 + y*r11 + z*r12 + ty, x*r20 + y*r21 + z*r22 + tz));
+			}
+		}
+		m_lastSweep = stamp;
+		processScan(stamp);
+	}
+
+	//! Check if the scan taken at the given time must be processed
+	bool acceptScan(const ros::Time &stamp)
+	{
+		// If the filter is not initialized then exit, unless it can be localized from the descriptors
+		if(!m_init && !m_recognitionPending)
+			return false;
+			
+		// Check if an update must be performed or not
+		if(!m_doUpdate && !m_recognitionPending && !checkUpdateThresholds(stamp))
+			return false;
+		if(m_recognitionPending)
+		{
+			if((ros::Time::now() - m_lastRecognition).toSec() < 1.0)
+				return false;
+			m_lastRecognition = ros::Time::now();
+		}
+
+		return true;
+	}
+
+	//! Transform the cloud into the base frame and append its points into the scan buffer. The 
+	//! transform of each sensor frame is looked up only once
+	bool appendCloud(const sensor_msgs::PointCloud2 &cloud)
+	{
+		tf::StampedTransform sensorTf;
+		if(!getSensorTf(cloud.header.frame_id, sensorTf))
+			return false;
+		const tf::Matrix3x3 &R = sensorTf.getBasis();
+		const tf::Vector3 &t = sensorTf.getOrigin();
+		float r00 = R[0][0], r01 = R[0][1], r02 = R[0][2], tx = t.x();
+		float r10 = R[1][0], r11 = R[1][1], r12 = R[1][2], ty = t.y();
+		float r20 = R[2][0], r21 = R[2][1], r22 = R[2][2], tz = t.z();
+
+		sensor_msgs::PointCloud2ConstIterator<float> iterX(cloud, "x");
+		sensor_msgs::PointCloud2ConstIterator<float> iterY(cloud, "y");
+		sensor_msgs::PointCloud2ConstIterator<float> iterZ(cloud, "z");
+		m_scan.reserve(m_scan.size() + cloud.width*cloud.height);
+		for(int i=0; i<cloud.width*cloud.height; i++, ++iterX, ++iterY, ++iterZ) 
+		{
+			float x = *iterX, y = *iterY, z = *iterZ;
+			pcl::PointXYZ p(x*r00 + y*r01 + z*r02 + tx, x*r10 + y*r11 + z*r12 + ty, x*r20 + y*r21 + z*r22 + tz);
+			float d2 = p.x*p.x + p.y*p.y + p.z*p.z;
+			if(d2 > 1 && d2 < 10000)
+				m_scan.push_back(p);			
+		}
+
+		return true;
+	}
+
+	//! Transform from a sensor frame to the base frame, looked up only once
+	bool getSensorTf(const std::string &frameId, tf::StampedTransform &sensorTf)
+	{
+		std::map<std::string, tf::StampedTransform>::iterator it = m_sensorTfs.find(frameId);
+		if(it == m_sensorTfs.end())
 		{	
 			try
 			{
-                m_tfListener.waitForTransform(m_baseFrameId, cloud->header.frame_id, ros::Time(0), ros::Duration(2.0));
-                m_tfListener.lookupTransform(m_baseFrameId, cloud->header.frame_id, ros::Time(0), m_pclTf); //base2laser
-				m_tfCache = true;
+                m_tfListener.waitForTransform(m_baseFrameId, frameId, ros::Time(0), ros::Duration(2.0));
+                m_tfListener.lookupTransform(m_baseFrameId, frameId, ros::Time(0), sensorTf); //base2laser
 			}
 			catch (tf::TransformException ex)
 			{
 				ROS_ERROR("%s",ex.what());
-				return;
+				return false;
 			}
+			it = m_sensorTfs.insert(std::make_pair(frameId, sensorTf)).first;
 		}
-		sensor_msgs::PointCloud2 baseCloud;
-		pcl_ros::transformPointCloud(m_baseFrameId, m_pclTf, *cloud, baseCloud);
-		
-		// Uniform lidar downsampling based on front view projection
-		std::vector<pcl::PointXYZ> downCloud;
-		PointCloud2_to_PointXYZ(baseCloud, downCloud);
-			
+		sensorTf = it->second;
+
+		return true;
+	}
+
+	//! Register the scan buffer, in the base frame
+	void processScan(const ros::Time &stamp)
+	{
+		std::vector<pcl::PointXYZ> &downCloud = m_scan;
+
+		// Compute odometric translation and rotation since last update 
+		tf::StampedTransform odomTf;
+		try
+		{
+			m_tfListener.waitForTransform(m_odomFrameId, m_baseFrameId, ros::Time(0), ros::Duration(1.0));
+			m_tfListener.lookupTransform(m_odomFrameId, m_baseFrameId, ros::Time(0), odomTf); //latest时刻，odom2base
+		}
+		catch (tf::TransformException ex)
+		{
+			ROS_ERROR("%s",ex.what());
+			return;
+		}
+		tf::Transform mapTf;
+		mapTf = m_lastGlobalTf * odomTf; //mapTf： latest时刻，map2base初值
+
 		// Get estimated position into the map
 		double tx, ty, tz;
 		tx = mapTf.getOrigin().getX();
@@ -294,18 +736,49 @@ private:
 			points[i].z = x*r20 + y*r21 + z*r22;			
 		}
 
-		// Launch DLL solver
+		// Global localization, the best candidate is refined as usual next
+		if(m_recognitionPending)
+		{
+			if(!recognizePlace(points, tx, ty, tz, m_yaw))
+				return;
+			m_recognitionPending = false;
+			m_init = true;
+			m_solver.resetState();
+		}
+
+		// Seed the solver with the best pose around a coarse initial pose
+		if(m_poseSearchPending)
+		{
+			searchInitialPose(points, tx, ty, tz, m_yaw);
+			m_poseSearchPending = false;
+		}
+
+		// Sort points by their voxel at the predicted pose, so field lookups are mostly sequential
+		if(m_sortPoints)
+			sortPoints(points, tx, ty, tz, m_yaw);
+
+		// Launch DLL solver. The aligned cloud is taken from the solver, only if someone is listening
+		bool publishAligned = m_publishAligned && m_alignedPub.getNumSubscribers() > 0;
 		if(m_alignMethod == 1) // DLL solver
+		{
+			if(m_solverBenchmark)
+				benchmarkSolvers(points, tx, ty, tz, m_yaw);
+			m_solver.setStoreAligned(publishAligned);
 			m_solver.solve(points, tx, ty, tz, m_yaw);
+			m_solver.setStoreAligned(false);
+		}
 		else if(m_alignMethod == 2) // NDT solver
 			m_grid3d.alignNDT(points, tx, ty, tz, m_yaw);
 		else if(m_alignMethod == 3) // ICP solver
 			m_grid3d.alignICP(points, tx, ty, tz, m_yaw);
 
+		if(publishAligned && m_alignMethod == 1)
+			publishAlignedCloud(stamp);
+
 		// Update global TF
 		tf::Quaternion q;
 		q.setRPY(m_roll, m_pitch, m_yaw);
-		m_lastGlobalTf = tf::Transform(q, tf::Vector3(tx, ty, tz))*odomTf.inverse();
+		setGlobalTf(tf::Transform(q, tf::Vector3(tx, ty, tz))*odomTf.inverse());
 
 		// Update time and transform information
 		m_lastOdomTf = odomTf;
@@ -341,7 +814,11 @@ private:
 		// Update global TF
 		tf::Quaternion q;
 		q.setRPY(m_roll, m_pitch, m_yaw);
-		m_lastGlobalTf = tf::Transform(q, tf::Vector3(t.x(), t.y(), t.z()+m_initZOffset))*m_lastOdomTf.inverse();
+		setGlobalTf(tf::Transform(q, tf::Vector3(t.x(), t.y(), t.z()+m_initZOffset))*m_lastOdomTf.inverse());
+
+		// The solver state of the previous pose does not apply anymore
+		m_solver.resetState();
+		m_recognitionPending = false;
 
 		// Prepare next iterations		
 		m_doUpdate = false;
@@ -358,32 +835,221 @@ private:
 		return (float)yaw;
 	}
 
-	bool PointCloud2_to_PointXYZ(sensor_msgs::PointCloud2 &in, std::vector<pcl::PointXYZ> &out)
-	{		
-		sensor_msgs::PointCloud2Iterator<float> iterX(in, "x");
-		sensor_msgs::PointCloud2Iterator<float> iterY(in, "y");
-		sensor_msgs::PointCloud2Iterator<float> iterZ(in, "z");
-		out.clear();
-		for(int i=0; i<in.width*in.height; i++, ++iterX, ++iterY, ++iterZ) 
+	//! Interleave the 21 lower bits of x, y and z
+	static uint64_t mortonCode(uint32_t x, uint32_t y, uint32_t z)
+	{
+		uint64_t code = 0;
+		for(int i=0; i<21; i++)
+			code |= ((uint64_t)((x >> i) & 1) << (3*i)) | ((uint64_t)((y >> i) & 1) << (3*i+1)) | ((uint64_t)((z >> i) & 1) << (3*i+2));
+		return code;
+	}
+
+	//! Sort the points in Morton order of their voxel into the map at the given pose
+	void sortPoints(std::vector<pcl::PointXYZ> &points, double tx, double ty, double tz, double yaw)
+	{
+		float oneDivRes = 1.0/m_grid3d.getResolution();
+		float sa = sin(yaw), ca = cos(yaw);
+		m_sortKeys.resize(points.size());
+		for(int i=0; i<points.size(); i++)
 		{
-			pcl::PointXYZ p(*iterX, *iterY, *iterZ);
-			float d2 = p.x*p.x + p.y*p.y + p.z*p.z;
-			if(d2 > 1 && d2 < 10000)
-				out.push_back(p);			
+			// Voxel coordinates clamped to the 21 bits of the code
+			float nx = (ca*points[i].x - sa*points[i].y + tx)*oneDivRes;
+			float ny = (sa*points[i].x + ca*points[i].y + ty)*oneDivRes;
+			float nz = (points[i].z + tz)*oneDivRes;
+			uint32_t ix = (uint32_t)std::min(std::max(nx, 0.0f), 2097151.0f);
+			uint32_t iy = (uint32_t)std::min(std::max(ny, 0.0f), 2097151.0f);
+			uint32_t iz = (uint32_t)std::min(std::max(nz, 0.0f), 2097151.0f);
+			m_sortKeys[i] = std::make_pair(mortonCode(ix, iy, iz), i);
+		}
+		std::sort(m_sortKeys.begin(), m_sortKeys.end());
+		m_sortBuffer.resize(points.size());
+		for(int i=0; i<points.size(); i++)
+			m_sortBuffer[i] = points[m_sortKeys[i].second];
+		points.swap(m_sortBuffer);
+	}
+
+	//! Pose of the tilt-compensated scan from the place recognition descriptors: the best candidates
+	//! are refined with the solver and the one that best fits the map is kept
+	bool recognizePlace(std::vector<pcl::PointXYZ> &points, double &tx, double &ty, double &tz, double &yaw)
+	{
+		ros::WallTime start = ros::WallTime::now();
+		ScanContext::Entry query;
+		std::vector<ScanContext::Candidate> candidates;
+		m_descriptors.compute(points, query.key, query.desc);
+		m_descriptors.query(query.key, query.desc, m_recognitionCandidates, candidates);
+
+		float bestWeight = 0.0;
+		for(size_t i=0; i<candidates.size(); i++)
+		{
+			double x = candidates[i].x, y = candidates[i].y, z = candidates[i].z, a = candidates[i].yaw;
+			m_solver.resetState();
+			m_solver.solve(points, x, y, z, a);
+
+			// Fit of the refined candidate, mean probability of the scan into the map
+			double ca = cos(a), sa = sin(a);
+			m_recognitionBuffer.resize(points.size());
+			for(size_t j=0; j<points.size(); j++)
+			{
+				m_recognitionBuffer[j].x = ca*points[j].x - sa*points[j].y + x;
+				m_recognitionBuffer[j].y = sa*points[j].x + ca*points[j].y + y;
+				m_recognitionBuffer[j].z = points[j].z + z;
+			}
+			float weight = m_grid3d.computeCloudWeight(m_recognitionBuffer);
+			if(weight > bestWeight)
+			{
+				bestWeight = weight;
+				tx = x; ty = y; tz = z; yaw = a;
+			}
 		}
+		if(bestWeight <= 0.0)
+		{
+			ROS_WARN("Place recognition failed, retrying with the next scan");
+			return false;
+		}
+		ROS_INFO("Place recognition: %.3f %.3f %.3f %.3f (weight %.3f, %d candidates, %.1f ms)", tx, ty, tz, yaw, bestWeight, 
+				 (int)candidates.size(), (ros::WallTime::now() - start).toSec()*1000.0);
 
 		return true;
 	}
 
+	//! Correlative search of the initial pose over x, y and yaw on a decimated scan
+	void searchInitialPose(std::vector<pcl::PointXYZ> &points, double &tx, double &ty, double tz, double &yaw)
+	{
+		int step = std::max(1, (int)points.size()/std::max(1, m_poseSearchPoints));
+		m_poseSearchBuffer.clear();
+		for(size_t i=0; i<points.size(); i+=step)
+			m_poseSearchBuffer.push_back(points[i]);
+
+		ros::WallTime start = ros::WallTime::now();
+		double x = tx, y = ty, a = yaw;
+		float score = m_grid3d.alignCorrelative(m_poseSearchBuffer, x, y, tz, a, m_poseSearchXY, m_poseSearchYaw, 
+												std::max(0.1, (double)m_grid3d.getResolution()), 0.02);
+		ROS_INFO("Initial pose search: %.3f %.3f %.3f -> %.3f %.3f %.3f (score %.3f, %.1f ms)", tx, ty, yaw, x, y, a, score, 
+				 (ros::WallTime::now() - start).toSec()*1000.0);
+		tx = x;
+		ty = y;
+		yaw = a;
+	}
+
+	//! Solve the scan with Ceres and with Newton steps from the same initial pose and log both.
+	//! The pose is not modified, the configured solver runs next as usual
+	void benchmarkSolvers(std::vector<pcl::PointXYZ> &points, double tx, double ty, double tz, double yaw)
+	{
+		double x[2][4];
+		int iterations[2];
+		double elapsed[2];
+		for(int k=0; k<2; k++)
+		{
+			// Copy of the solver, so that both start from the state of the real solve and leave it untouched
+			DLLSolver solver(m_solver);
+			solver.setNewton(k == 1);
+			solver.setStoreAligned(false);
+			x[k][0] = tx; x[k][1] = ty; x[k][2] = tz; x[k][3] = yaw;
+			ros::WallTime start = ros::WallTime::now();
+			solver.solve(points, x[k][0], x[k][1], x[k][2], x[k][3]);
+			elapsed[k] = (ros::WallTime::now() - start).toSec()*1000.0;
+			iterations[k] = solver.getLastIterations();
+		}
+		double dt = sqrt((x[0][0]-x[1][0])*(x[0][0]-x[1][0]) + (x[0][1]-x[1][1])*(x[0][1]-x[1][1]) + (x[0][2]-x[1][2])*(x[0][2]-x[1][2]));
+		ROS_INFO("Solver benchmark: ceres %d it %.2f ms, newton %d it %.2f ms, difference %.4f m %.4f rad",
+				 iterations[0], elapsed[0], iterations[1], elapsed[1], dt, fabs(x[0][3]-x[1][3]));
+	}
+
+	//! Publish the tilt-compensated cloud at the solved pose, with the final residual as intensity
+	void publishAlignedCloud(const ros::Time &stamp)
+	{
+		const std::vector<pcl::PointXYZ> &points = m_solver.getAlignedPoints();
+		const std::vector<float> &residuals = m_solver.getAlignedResiduals();
+
+		// Setup the msg layout only once, later calls just resize the data buffer
+		if(m_alignedMsg.fields.empty())
+		{
+			sensor_msgs::PointCloud2Modifier modifier(m_alignedMsg);
+			modifier.setPointCloud2Fields(4, "x", 1, sensor_msgs::PointField::FLOAT32,
+											 "y", 1, sensor_msgs::PointField::FLOAT32,
+											 "z", 1, sensor_msgs::PointField::FLOAT32,
+											 "intensity", 1, sensor_msgs::PointField::FLOAT32);
+		}
+		sensor_msgs::PointCloud2Modifier modifier(m_alignedMsg);
+		modifier.resize(points.size());
+		m_alignedMsg.header.frame_id = m_globalFrameId;
+		m_alignedMsg.header.stamp = stamp;
+
+		// Points and residuals of the solver at the final solution
+		sensor_msgs::PointCloud2Iterator<float> iterX(m_alignedMsg, "x");
+		sensor_msgs::PointCloud2Iterator<float> iterY(m_alignedMsg, "y");
+		sensor_msgs::PointCloud2Iterator<float> iterZ(m_alignedMsg, "z");
+		sensor_msgs::PointCloud2Iterator<float> iterI(m_alignedMsg, "intensity");
+		for(int i=0; i<points.size(); i++, ++iterX, ++iterY, ++iterZ, ++iterI)
+		{
+			*iterX = points[i].x;
+			*iterY = points[i].y;
+			*iterZ = points[i].z;
+			*iterI = fabs(residuals[i]);
+		}
+		m_alignedPub.publish(m_alignedMsg);
+	}
+
 	//! Indicates if the filter was initialized
 	bool m_init;
 
 	//! Use IMU flag
 	bool m_use_imu;
+
+	//! Spatial sorting of the scan (reused buffers)
+	bool m_sortPoints;
+	std::vector< std::pair<uint64_t, int> > m_sortKeys;
+	std::vector<pcl::PointXYZ> m_sortBuffer;
+
+	//! Run both solvers on every scan and log their iterations and time
+	bool m_solverBenchmark;
+
+	//! Global localization from the place recognition descriptors (reused buffer)
+	bool m_placeRecognition, m_recognitionPending;
+	int m_recognitionCandidates;
+	ros::Time m_lastRecognition;
+	ScanContext m_descriptors;
+	std::vector<pcl::PointXYZ> m_recognitionBuffer;
+
+	//! Correlative search around poses from initial_pose (decimated scan buffer)
+	bool m_poseSearch, m_poseSearchPending;
+	double m_poseSearchXY, m_poseSearchYaw;
+	int m_poseSearchPoints;
+	std::vector<pcl::PointXYZ> m_poseSearchBuffer;
+
+	//! Aligned cloud output (reused buffer)
+	bool m_publishAligned;
+	sensor_msgs::PointCloud2 m_alignedMsg;
 	
-	//! Indicates that the local transfrom for the pint-cloud is cached
-	bool m_tfCache;
-	tf::StampedTransform m_pclTf;
+	//! Cached transforms from each sensor frame to the base frame
+	std::map<std::string, tf::StampedTransform> m_sensorTfs;
+
+	//! Scan in the base frame, merged from all the input clouds (reused buffer)
+	std::vector<pcl::PointXYZ> m_scan;
+
+	//! Depth camera input: strided pixels with their byte offset and their ray in the base frame
+	std::string m_inDepthTopic, m_inDepthInfoTopic, m_depthFrameId;
+	int m_depthStride;
+	uint32_t m_depthStep;
+	double m_depthMinRange, m_depthMaxRange;
+	sensor_msgs::CameraInfo m_depthInfo;
+	std::vector<size_t> m_depthOffsets;
+	std::vector<float> m_depthRays;
+
+	//! Ring of the last frames for sparse lidars, in the base frame with their odometry
+	struct ScanFrame
+	{
+		std::vector<pcl::PointXYZ> points;
+		tf::Transform odom;
+	};
+	std::vector<ScanFrame> m_frames;
+	int m_accumulateFrames, m_frameHead, m_frameCount;
+	double m_accumulateRate;
+	ros::Time m_lastSweep;
+
+	//! Latest cloud of each topic when there are several lidars
+	std::vector<sensor_msgs::PointCloud2ConstPtr> m_cloudSlots;
+	double m_syncTolerance;
 	
 	//! Particles roll and pich (given by IMU)
 	double m_roll, m_pitch, m_yaw;
@@ -402,6 +1068,7 @@ private:
 		
 	//! Node parameters
 	std::string m_inCloudTopic;
+	std::vector<std::string> m_inCloudTopics;
 	std::string m_baseFrameId;
 	std::string m_odomFrameId;
 	std::string m_globalFrameId;
@@ -411,7 +1078,25 @@ private:
 	tf::TransformBroadcaster m_tfBr;
 	tf::TransformListener m_tfListener;
     ros::Subscriber m_pcSub, m_initialPoseSub, m_imuSub;
-	ros::Timer updateTimer;
+	std::vector<ros::Subscriber> m_pcSubs;
+	ros::Subscriber m_depthSub, m_depthInfoSub;
+	ros::Publisher m_alignedPub;
+
+	//! Map frame odometry output, with its own callback queue and thread
+	bool m_publishOdometry;
+	std::string m_odomTopic;
+	ros::NodeHandle m_odomNh;
+	ros::CallbackQueue m_odomQueue;
+	boost::shared_ptr<ros::AsyncSpinner> m_odomSpinner;
+	ros::Subscriber m_odomSub;
+	ros::Publisher m_odomPub;
+	nav_msgs::Odometry m_odomMsg;
+	struct GlobalTfData
+	{
+		double x, y, z, qx, qy, qz, qw;
+	};
+	DoubleBuffer<GlobalTfData> m_globalTfBuffer;
+	ros::Timer m_tfTimer;
 	
 	//! 3D distance drid
     Grid3d m_grid3d;
@@ -2,6 +2,8 @@
 #define __DLLSOLVER_HPP__
 
 #include <vector>
+#include <algorithm>
+#include <Eigen/Dense>
 #include "ceres/ceres.h"
 #include "glog/logging.h"
 #include "grid3d.hpp"
@@ -14,15 +16,42 @@ using ceres::Solver;
 using ceres::Solve;
 using ceres::HuberLoss;
 
-class DLLCostFunction
-  : public SizedCostFunction<1 /* number of residuals */,
-                             4 /* size of first parameter */> 
+// Structure of arrays of a batch of points for the Newton kernel of DLLSolver, so that the per
+// point terms are computed in SIMD lanes. Points past the end of the scan are padded with zeros
+template<typename T>
+struct NewtonBatch
 {
- public:
-    DLLCostFunction(double px, double py, double pz, Grid3d &grid, double weight = 1.0)
-      : _px(px), _py(py), _pz(pz), _grid(grid), _weight(weight)
+    enum { SIZE = 64, LANES = 8 };
+
+    // Transformed points, their derivatives with respect to the yaw and weights
+    T nx[SIZE], ny[SIZE], nz[SIZE], dxa[SIZE], dya[SIZE], w[SIZE];
+
+    // Field coefficients of the cell of each point
+    T a0[SIZE], a1[SIZE], a2[SIZE], a3[SIZE], a4[SIZE], a5[SIZE], a6[SIZE], a7[SIZE];
+
+    // Residuals and Cauchy weights computed by the kernel
+    T r[SIZE], rho1[SIZE];
+
+    void pad(int k)
     {
+        nx[k] = ny[k] = nz[k] = dxa[k] = dya[k] = w[k] = 0;
+        a0[k] = a1[k] = a2[k] = a3[k] = a4[k] = a5[k] = a6[k] = a7[k] = 0;
+    }
+};
 
+// One residual per point. The parameter block is [tx, ty, tz, yaw], or [tx, ty, yaw] in planar
+// mode, where the height of the robot is fixed to the given tz
+class DLLCostFunction : public CostFunction 
+{
+ public:
+    DLLCostFunction(double px, double py, double pz, Grid3d &grid, double weight = 1.0, const pcl::PointXYZ *next = NULL, 
+                    bool planar = false, double tz = 0.0)
+      : _px(px), _py(py), _pz(pz), _grid(grid), _weight(weight), _next(next), _planar(planar), _tz(tz)
+    {
+        _lx[0] = _lx[1] = _lx[2] = _lx[3] = NAN;
+        _min[0] = _min[1] = _min[2] = _max[0] = _max[1] = _max[2] = NAN;
+        set_num_residuals(1);
+        mutable_parameter_block_sizes()->push_back(planar ? 3 : 4);
     }
 
     virtual ~DLLCostFunction(void) 
@@ -34,13 +63,15 @@ class DLLCostFunction
                           double* residuals,
                           double** jacobians) const 
     {
+        if(_planar)
+            return EvaluatePlanar(parameters[0], residuals, jacobians);
+
         double tx = parameters[0][0];
         double ty = parameters[0][1];
         double tz = parameters[0][2];
         double a  = parameters[0][3]; //yaw
 
         // Compute the residual
-        TrilinearParams p;
         double sa, ca, nx, ny, nz, dxa, dya;
         double c0, c1, c2, c3, c4, c5, c6, c7;
         sa = sin(a);
@@ -48,10 +79,21 @@ class DLLCostFunction
         nx = ca*_px - sa*_py + tx;
         ny = sa*_px + ca*_py + ty;
         nz = _pz + tz; //[nx, ny, nz]: Rz(yaw)* p + t
-        p = _grid.getPointDistInterpolation(nx, ny, nz);
+
+        // Fetch the cell parameters only if the point left the bounds of the last fetch
+        if(!inCell(nx, ny, nz))
+        {
+            // Prefetch the cell of the next point while this one is fetched, it probably moved too
+            if(_next != NULL)
+                _grid.prefetchPointDistInterpolation(ca*_next->x - sa*_next->y + tx, sa*_next->x + ca*_next->y + ty, _next->z + tz);
+            _params = _grid.getPointDistInterpolation(nx, ny, nz);
+            _grid.getPointVoxelBounds(nx, ny, nz, _min, _max);
+        }
+        const TrilinearParams &p = _params;
         c0 = p.a0; c1 = p.a1; c2 = p.a2; c3 = p.a3; c4 = p.a4; c5 = p.a5; c6 = p.a6; c7 = p.a7;
 
         residuals[0] =  _weight*(c0 + c1*nx + c2*ny + c3*nz + c4*nx*ny + c5*nx*nz + c6*ny*nz + c7*nx*ny*nz);
+        record(tx, ty, tz, a, nx, ny, nz, residuals[0]);
 
         if (jacobians != NULL && jacobians[0] != NULL) 
         {
@@ -67,6 +109,94 @@ class DLLCostFunction
         return true;
     }
 
+    //! Planar kernel over [tx, ty, yaw]
+    bool EvaluatePlanar(const double *x, double *residuals, double **jacobians) const
+    {
+        double sa, ca, nx, ny, nz;
+        sa = sin(x[2]);
+        ca = cos(x[2]);
+        nx = ca*_px - sa*_py + x[0];
+        ny = sa*_px + ca*_py + x[1];
+        nz = _pz + _tz;
+
+        if(!inCell(nx, ny, nz))
+        {
+            if(_next != NULL)
+                _grid.prefetchPointDistInterpolation(ca*_next->x - sa*_next->y + x[0], sa*_next->x + ca*_next->y + x[1], _next->z + _tz);
+            _params = _grid.getPointDistInterpolation(nx, ny, nz);
+            _grid.getPointVoxelBounds(nx, ny, nz, _min, _max);
+        }
+        const TrilinearParams &p = _params;
+
+        // nz is constant, so the polynomial is bilinear in nx, ny
+        double b0 = p.a0 + p.a3*nz, b1 = p.a1 + p.a5*nz, b2 = p.a2 + p.a6*nz, b3 = p.a4 + p.a7*nz;
+        residuals[0] = _weight*(b0 + b1*nx + b2*ny + b3*nx*ny);
+        record(x[0], x[1], _tz, x[2], nx, ny, nz, residuals[0]);
+
+        if (jacobians != NULL && jacobians[0] != NULL) 
+        {
+            double fx = _weight*(b1 + b3*ny);
+            double fy = _weight*(b2 + b3*nx);
+            jacobians[0][0] = fx;
+            jacobians[0][1] = fy;
+            jacobians[0][2] = -fx*(_py*ca + _px*sa) + fy*(_px*ca - _py*sa);
+        }
+
+        return true;
+    }
+
+    //! Transformed point and field coefficients of the point into slot k of a Newton batch, for
+    //! the full [tx, ty, tz, yaw] parameters. The yaw sine and cosine are computed once per scan
+    template<typename T>
+    void gather(const double *x, double sa, double ca, NewtonBatch<T> &b, int k) const
+    {
+        double nx, ny, nz;
+        nx = ca*_px - sa*_py + x[0];
+        ny = sa*_px + ca*_py + x[1];
+        nz = _pz + x[2];
+
+        if(!inCell(nx, ny, nz))
+        {
+            _params = _grid.getPointDistInterpolation(nx, ny, nz);
+            _grid.getPointVoxelBounds(nx, ny, nz, _min, _max);
+        }
+        const TrilinearParams &p = _params;
+        b.nx[k] = nx; b.ny[k] = ny; b.nz[k] = nz;
+        b.dxa[k] = _py*ca + _px*sa;
+        b.dya[k] = _px*ca - _py*sa;
+        b.w[k] = _weight;
+        b.a0[k] = p.a0; b.a1[k] = p.a1; b.a2[k] = p.a2; b.a3[k] = p.a3;
+        b.a4[k] = p.a4; b.a5[k] = p.a5; b.a6[k] = p.a6; b.a7[k] = p.a7;
+    }
+
+    //! True if the transformed point is still within the bounds of the cached parameters
+    inline bool inCell(double nx, double ny, double nz) const
+    {
+        return nx >= _min[0] && nx < _max[0] && ny >= _min[1] && ny < _max[1] && nz >= _min[2] && nz < _max[2];
+    }
+
+    //! True if the last evaluation was done at the given [tx, ty, tz, yaw]
+    bool evaluatedAt(const double *x) const
+    {
+        return _lx[0] == x[0] && _lx[1] == x[1] && _lx[2] == x[2] && _lx[3] == x[3];
+    }
+
+    //! Transformed point and residual of the last evaluation
+    void getLastEvaluation(pcl::PointXYZ &p, float &r) const
+    {
+        p.x = _nx;
+        p.y = _ny;
+        p.z = _nz;
+        r = _r;
+    }
+
+    //! Keep the parameters, transformed point and residual of an evaluation
+    inline void record(double tx, double ty, double tz, double a, float nx, float ny, float nz, float r) const
+    {
+        _lx[0] = tx; _lx[1] = ty; _lx[2] = tz; _lx[3] = a;
+        _nx = nx; _ny = ny; _nz = nz; _r = r;
+    }
+
   private:
 
     // Point to be evaluated
@@ -79,6 +209,22 @@ class DLLCostFunction
 
     // Constraint weight factor
     double _weight;
+
+    // Next point to be evaluated (for prefetching)
+    const pcl::PointXYZ *_next;
+
+    // Planar mode with fixed height
+    bool _planar;
+    double _tz;
+
+    // Parameters of the last fetch and the bounds where they hold. Each residual block is
+    // evaluated by a single thread at a time, so there is no need to protect them
+    mutable float _min[3], _max[3];
+    mutable TrilinearParams _params;
+
+    // Parameters, transformed point and residual of the last evaluation
+    mutable double _lx[4];
+    mutable float _nx, _ny, _nz, _r;
 };
 
 class DLLSolver
@@ -91,12 +237,76 @@ class DLLSolver
     // Optimizer parameters
     int _max_num_iterations;
 
+    // Active set shrinking of the Newton solver: points whose Cauchy weight stays under 
+    // _active_set_weight for _active_set_rounds accepted steps are no longer evaluated, keeping
+    // at least _active_set_min_ratio of the scan. They are checked again at convergence
+    bool _active_set;
+    int _active_set_rounds;
+    double _active_set_weight, _active_set_min_ratio;
+    double _loss_scale;
+
+    // Damped Newton solver with the exact Hessian of the trilinear field instead of Ceres
+    bool _newton;
+
+    // Optimize only x, y and yaw, the height is kept
+    bool _planar;
+
+    // Evaluate the Newton kernels in float, the field precision, reducing the system in double
+    bool _mixed_precision;
+
+    // Cauchy weights of the points of the last Newton evaluation, and scratch lists of the
+    // active set shrinking
+    std::vector<double> _weights;
+    std::vector< std::pair<double, int> > _candidates;
+    std::vector<DLLCostFunction *> _removed;
+
+    // Iterations of the last solve
+    int _last_iterations;
+
+    // Adaptive state carried from scan to scan: Ceres trust region radius and Newton damping.
+    // It is reset when the initial pose jumps more than _reset_distance or _reset_angle 
+    // away from the last solution
+    bool _warm_start, _state_valid;
+    double _trust_radius, _damping;
+    double _reset_distance, _reset_angle;
+    double _last_x[4];
+
+    // Robust scale estimation: the Cauchy scale is set each scan to _scale_factor times the MAD 
+    // based standard deviation of the initial residuals, bounded to [_min_scale, _max_scale]
+    // and averaged with the previous estimate while tracking
+    bool _adaptive_scale;
+    double _scale_factor, _min_scale, _max_scale;
+    std::vector<double> _residuals;
+
+    // Transformed points and residuals at the last solution, kept only if requested
+    bool _store_aligned;
+    std::vector<pcl::PointXYZ> _aligned_points;
+    std::vector<float> _aligned_residuals;
+
   public:
 
     DLLSolver(Grid3d &grid) : _grid(grid)
     {
         google::InitGoogleLogging("DLLSolver");
         _max_num_iterations = 300; //default: 100
+        _active_set = false;
+        _active_set_rounds = 2;
+        _active_set_weight = 0.01;
+        _active_set_min_ratio = 0.3;
+        _loss_scale = 0.1;
+        _newton = false;
+        _planar = false;
+        _mixed_precision = false;
+        _last_iterations = 0;
+        _warm_start = true;
+        _reset_distance = 1.0;
+        _reset_angle = 0.5;
+        _adaptive_scale = false;
+        _scale_factor = 2.3849;  // 95% efficiency of the Cauchy loss under Gaussian noise
+        _min_scale = 0.01;
+        _max_scale = 1.0;
+        _store_aligned = false;
+        resetState();
     }
 
     ~DLLSolver(void)
@@ -115,21 +325,192 @@ class DLLSolver
             return false;
     }
 
+    void setActiveSet(bool enable)
+    {
+        _active_set = enable;
+    }
+
+    void setNewton(bool enable)
+    {
+        _newton = enable;
+    }
+
+    bool getNewton(void)
+    {
+        return _newton;
+    }
+
+    void setPlanar(bool enable)
+    {
+        _planar = enable;
+    }
+
+    void setMixedPrecision(bool enable)
+    {
+        _mixed_precision = enable;
+    }
+
+    void setWarmStart(bool enable, double resetDistance, double resetAngle)
+    {
+        _warm_start = enable;
+        _reset_distance = resetDistance;
+        _reset_angle = resetAngle;
+    }
+
+    void setLossScale(double scale)
+    {
+        _loss_scale = scale;
+    }
+
+    void setAdaptiveScale(bool enable, double minScale, double maxScale)
+    {
+        _adaptive_scale = enable;
+        _min_scale = minScale;
+        _max_scale = maxScale;
+    }
+
+    double getLossScale(void)
+    {
+        return _loss_scale;
+    }
+
+    //! Forget the adaptive state, e.g. after the pose is reinitialized
+    void resetState(void)
+    {
+        _state_valid = false;
+        _trust_radius = 1e4;  // Ceres default
+        _damping = 1e-4;
+    }
+
+    int getLastIterations(void)
+    {
+        return _last_iterations;
+    }
+
+    //! Keep the transformed points and residuals of the next solutions
+    void setStoreAligned(bool enable)
+    {
+        _store_aligned = enable;
+    }
+
+    const std::vector<pcl::PointXYZ> &getAlignedPoints(void)
+    {
+        return _aligned_points;
+    }
+
+    const std::vector<float> &getAlignedResiduals(void)
+    {
+        return _aligned_residuals;
+    }
+
     bool solve(std::vector<pcl::PointXYZ> &p, double &tx, double &ty, double &tz, double &yaw)
     {
-        // Initial solution
-        double x[4];
+        // Initial solution. Ceres optimizes xc, without the height in planar mode
+        double x[4], xp[3], *xc = x;
         x[0] = tx; x[1] = ty; x[2] = tz; x[3] = yaw; 
-
-        // Build the problem.
-        Problem problem;
+        if(_planar)
+        {
+            xp[0] = tx; xp[1] = ty; xp[2] = yaw;
+            xc = xp;
+        }
 
         // Set up a cost funtion per point into the cloud
+        std::vector<DLLCostFunction *> costs(p.size());
         for(unsigned int i=0; i<p.size(); i++)
+            costs[i] = new DLLCostFunction(p[i].x, p[i].y, p[i].z, _grid, 1.0, i+1 < p.size() ? &p[i+1] : NULL, _planar, tz);
+
+        // Start from the previous adaptive state only while tracking
+        if(!_warm_start || !_state_valid || 
+           sqrt((x[0]-_last_x[0])*(x[0]-_last_x[0]) + (x[1]-_last_x[1])*(x[1]-_last_x[1]) + (x[2]-_last_x[2])*(x[2]-_last_x[2])) > _reset_distance ||
+           fabs(remainder(x[3]-_last_x[3], 2*M_PI)) > _reset_angle)
+            resetState();
+        if(_adaptive_scale)
+            estimateScale(costs, xc);
+
+        if(_newton)
+            _last_iterations = solveNewton(costs, x);
+        else
         {
-            CostFunction* cost_function = new DLLCostFunction(p[i].x, p[i].y, p[i].z, _grid);
-            problem.AddResidualBlock(cost_function, new ceres::CauchyLoss(0.1), x); 
+            _last_iterations = solveCeres(costs, xc);
+            if(_planar)
+            {
+                x[0] = xp[0]; x[1] = xp[1]; x[3] = xp[2];
+            }
         }
+        for(int k=0; k<4; k++)
+            _last_x[k] = x[k];
+        _state_valid = true;
+        if(_store_aligned)
+            storeAligned(costs, x);
+
+        // Get the solution
+        tx = x[0]; ty = x[1]; tz = x[2]; yaw = x[3];
+
+        for(unsigned int i=0; i<costs.size(); i++)
+            delete costs[i];
+
+        return true; 
+    }
+
+  private:
+
+    //! Take the transformed points and residuals at the solution from the last evaluation of each 
+    //! point. Only the points last evaluated elsewhere (e.g. at a rejected step) are evaluated again
+    void storeAligned(std::vector<DLLCostFunction *> &costs, const double *x)
+    {
+        double xp[3] = {x[0], x[1], x[3]}, r;
+        const double *params[1] = {_planar ? xp : x};
+        _aligned_points.resize(costs.size());
+        _aligned_residuals.resize(costs.size());
+        for(unsigned int i=0; i<costs.size(); i++)
+        {
+            if(!costs[i]->evaluatedAt(x))
+                costs[i]->Evaluate(params, &r, NULL);
+            costs[i]->getLastEvaluation(_aligned_points[i], _aligned_residuals[i]);
+        }
+    }
+
+    //! Robust scale of the residuals at the initial pose from their median absolute deviation
+    void estimateScale(std::vector<DLLCostFunction *> &costs, double *x)
+    {
+        if(costs.empty())
+            return;
+        const double *params[1] = {x};
+        _residuals.resize(costs.size());
+        for(unsigned int i=0; i<costs.size(); i++)
+        {
+            costs[i]->Evaluate(params, &_residuals[i], NULL);
+            _residuals[i] = fabs(_residuals[i]);
+        }
+        std::vector<double>::iterator median = _residuals.begin() + _residuals.size()/2;
+        std::nth_element(_residuals.begin(), median, _residuals.end());
+        double scale = std::min(std::max(_scale_factor*1.4826*(*median), _min_scale), _max_scale);
+        _loss_scale = (_warm_start && _state_valid) ? 0.5*(_loss_scale + scale) : scale;
+    }
+
+    //! Run Ceres from the given trust region radius and update it with the final one, so that the
+    //! stages of a solve continue each other. Returns the iterations
+    int runSolver(Solver::Options &options, Problem &problem, Solver::Summary &summary, double &radius)
+    {
+        options.initial_trust_region_radius = radius;
+        Solve(options, &problem, &summary);
+        if(!summary.iterations.empty())
+            radius = std::min(std::max(summary.iterations.back().trust_region_radius, 1e-2), 1e8);
+
+        return summary.num_successful_steps + summary.num_unsuccessful_steps;
+    }
+
+    //! Optimize with Ceres 
+    int solveCeres(std::vector<DLLCostFunction *> &costs, double *x)
+    {
+        // Build the problem. Cost and loss functions are owned by solve()
+        Problem::Options problem_options;
+        problem_options.cost_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+        problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+        Problem problem(problem_options);
+        ceres::CauchyLoss loss(_loss_scale);
+        for(unsigned int i=0; i<costs.size(); i++)
+            problem.AddResidualBlock(costs[i], &loss, x); 
 
         // Run the solver!
         Solver::Options options;
@@ -138,12 +519,275 @@ class DLLSolver
         options.max_num_iterations = _max_num_iterations;
         options.num_threads = 10;  //default: 1
         Solver::Summary summary;
-        Solve(options, &problem, &summary);
+        double radius = _trust_radius;
+        int iterations = runSolver(options, problem, summary, radius);
+        if(_warm_start)
+            _trust_radius = radius;
 
-        // Get the solution
-        tx = x[0]; ty = x[1]; tz = x[2]; yaw = x[3];
+        return iterations;
+    }
 
-        return true; 
+    //! Robust cost, gradient and Hessian of the whole scan, with the Cauchy loss 
+    //! rho(s) = c^2*log(1 + s/c^2) applied to s = r^2, as Ceres does
+    double evaluateNewton(std::vector<DLLCostFunction *> &costs, const double *x, Eigen::Vector4d &g, Eigen::Matrix4d &H)
+    {
+        double cost;
+        if(_mixed_precision)
+            cost = evaluateNewton<float>(costs, x, g, H);
+        else
+            cost = evaluateNewton<double>(costs, x, g, H);
+
+        // Planar mode: the height is not a variable, a unit diagonal keeps its step at zero
+        if(_planar)
+        {
+            g(2) = 0.0;
+            H.row(2).setZero();
+            H.col(2).setZero();
+            H(2, 2) = 1.0;
+        }
+
+        return cost;
+    }
+
+    //! Per point terms are computed in T over batches of points, each SIMD lane accumulating its
+    //! own partial sums of the 4 gradient and 10 unique Hessian terms, which are reduced in double
+    //! after each batch. The cost is the log of the per lane products of the Cauchy terms.
+    //! The trilinear polynomial has constant second derivatives along each axis, so only the 
+    //! cross terms and the yaw curvature of the point transform contribute to the residual Hessian
+    template<typename T>
+    double evaluateNewton(std::vector<DLLCostFunction *> &costs, const double *x, Eigen::Vector4d &g, Eigen::Matrix4d &H)
+    {
+        typedef NewtonBatch<T> Batch;
+        const int L = Batch::LANES;
+        Batch b;
+        double sa = sin(x[3]), ca = cos(x[3]), c2d = _loss_scale*_loss_scale;
+        double cost = 0.0, sum[14] = {0};
+        T oneDivC2 = 1.0/c2d;
+        _weights.resize(costs.size());
+        for(size_t i0=0; i0<costs.size(); i0+=Batch::SIZE)
+        {
+            int n = std::min((size_t)Batch::SIZE, costs.size() - i0);
+            for(int k=0; k<n; k++)
+                costs[i0+k]->gather(x, sa, ca, b, k);
+            for(int k=n; k<Batch::SIZE; k++)
+                b.pad(k);
+
+            T acc[14][L] = {};
+            double q[L];
+            for(int l=0; l<L; l++)
+                q[l] = 1.0;
+            for(int k0=0; k0<Batch::SIZE; k0+=L)
+            {
+                for(int l=0; l<L; l++)
+                {
+                    int k = k0 + l;
+                    T nx = b.nx[k], ny = b.ny[k], nz = b.nz[k], dxa = b.dxa[k], dya = b.dya[k], w = b.w[k];
+
+                    // Field value, gradient and Hessian with respect to the transformed point
+                    T r = w*(b.a0[k] + b.a1[k]*nx + b.a2[k]*ny + b.a3[k]*nz + b.a4[k]*nx*ny + b.a5[k]*nx*nz + b.a6[k]*ny*nz + b.a7[k]*nx*ny*nz);
+                    T fx = w*(b.a1[k] + b.a4[k]*ny + b.a5[k]*nz + b.a7[k]*ny*nz);
+                    T fy = w*(b.a2[k] + b.a4[k]*nx + b.a6[k]*nz + b.a7[k]*nx*nz);
+                    T fz = w*(b.a3[k] + b.a5[k]*nx + b.a6[k]*ny + b.a7[k]*nx*ny);
+                    T fxy = w*(b.a4[k] + b.a7[k]*nz);
+                    T fxz = w*(b.a5[k] + b.a7[k]*ny);
+                    T fyz = w*(b.a6[k] + b.a7[k]*nx);
+
+                    // Chain rule with dn/dyaw = [-dxa, dya, 0] and d2n/dyaw2 = [-dya, -dxa, 0]
+                    T j3 = -fx*dxa + fy*dya;
+                    T h03 = fxy*dya, h13 = -fxy*dxa, h23 = -fxz*dxa + fyz*dya;
+                    T h33 = -2*fxy*dxa*dya - fx*dya - fy*dxa;
+
+                    // Cauchy loss rho(s) = c^2*log(1 + s/c^2) on s = r^2, as Ceres does. Robust 
+                    // Gauss-Newton and residual curvature weights
+                    T s = r*r;
+                    T rho1 = 1/(1 + s*oneDivC2);
+                    T rho2 = -rho1*rho1*oneDivC2;
+                    T a = rho1 + 2*rho2*s, br = rho1*r;
+                    T afx = a*fx, afy = a*fy, afz = a*fz, aj3 = a*j3;
+                    acc[0][l] += br*fx;                 acc[1][l] += br*fy;                 acc[2][l] += br*fz;                 acc[3][l] += br*j3;
+                    acc[4][l] += afx*fx;                acc[5][l] += afx*fy + br*fxy;       acc[6][l] += afx*fz + br*fxz;       acc[7][l] += afx*j3 + br*h03;
+                    acc[8][l] += afy*fy;                acc[9][l] += afy*fz + br*fyz;       acc[10][l] += afy*j3 + br*h13;
+                    acc[11][l] += afz*fz;               acc[12][l] += afz*j3 + br*h23;
+                    acc[13][l] += aj3*j3 + br*h33;
+                    q[l] *= 1.0 + (double)s/c2d;
+                    b.r[k] = r;
+                    b.rho1[k] = rho1;
+                }
+            }
+            for(int t=0; t<14; t++)
+                for(int l=0; l<L; l++)
+                    sum[t] += acc[t][l];
+            for(int l=0; l<L; l++)
+                cost += 0.5*c2d*log(q[l]);
+            for(int k=0; k<n; k++)
+            {
+                costs[i0+k]->record(x[0], x[1], x[2], x[3], b.nx[k], b.ny[k], b.nz[k], b.r[k]);
+                _weights[i0+k] = b.rho1[k];
+            }
+        }
+        g << sum[0], sum[1], sum[2], sum[3];
+        H << sum[4], sum[5],  sum[6],  sum[7],
+             sum[5], sum[8],  sum[9],  sum[10],
+             sum[6], sum[9],  sum[11], sum[12],
+             sum[7], sum[10], sum[12], sum[13];
+
+        return cost;
+    }
+
+    //! Newton steps on the exact robust Hessian, damped Levenberg-Marquardt style: the damping
+    //! grows until the damped Hessian is positive definite and the step decreases the cost
+    int solveNewton(std::vector<DLLCostFunction *> &costs, double *x)
+    {
+        Eigen::Vector4d g, gn;
+        Eigen::Matrix4d H, Hn;
+        double lambda = _damping, xn[4];
+
+        // Points evaluated at each step, the steps they have been saturated and the dropped ones
+        std::vector<DLLCostFunction *> active(costs), dropped;
+        std::vector<int> saturated(costs.size(), 0);
+        double cost = evaluateNewton(active, x, g, H);
+        int iterations = 0;
+        while(iterations < _max_num_iterations && lambda <= 1e12)
+        {
+            bool converged = g.lpNorm<Eigen::Infinity>() < 1e-10;
+            if(!converged)
+            {
+                iterations++;
+
+                // Damped step, relative to the Hessian diagonal scale
+                Eigen::Matrix4d A = H;
+                double scale = std::max(H.diagonal().cwiseAbs().maxCoeff(), 1e-12);
+                A.diagonal().array() += lambda*scale;
+                Eigen::LLT<Eigen::Matrix4d> llt(A);
+                if(llt.info() != Eigen::Success)
+                {
+                    lambda *= 10;
+                    continue;
+                }
+                Eigen::Vector4d dx = llt.solve(-g);
+                for(int k=0; k<4; k++)
+                    xn[k] = x[k] + dx(k);
+
+                // Accept the step only if the cost decreases
+                double costn = evaluateNewton(active, xn, gn, Hn);
+                if(costn < cost)
+                {
+                    converged = (cost - costn) < 1e-6*cost || dx.norm() < 1e-8*(Eigen::Map<Eigen::Vector4d>(x).norm() + 1e-8);
+                    for(int k=0; k<4; k++)
+                        x[k] = xn[k];
+                    cost = costn;
+                    g = gn;
+                    H = Hn;
+                    lambda = std::max(lambda/10, 1e-12);
+                    if(_active_set && !converged)
+                        cost = shrinkActiveSet(active, saturated, dropped, costs.size(), x, cost, g, H);
+                }
+                else
+                {
+                    // The model can not predict any significant decrease either, the rest is noise
+                    double predicted = -g.dot(dx) - 0.5*dx.dot(H*dx);
+                    converged = predicted < 1e-6*cost;
+                    if(!converged)
+                        lambda *= 10;
+                }
+            }
+
+            // Go on if some dropped point is not saturated at the solution
+            if(converged && !restoreActiveSet(active, saturated, dropped, x, cost, g, H))
+                break;
+        }
+        if(_warm_start)
+            _damping = std::min(std::max(lambda, 1e-8), 1e2);
+
+        return iterations;
+    }
+
+    //! Drop the active points saturated for the last _active_set_rounds steps, taking their
+    //! terms at x out of the cost, gradient and Hessian. Returns the cost of the remaining points
+    double shrinkActiveSet(std::vector<DLLCostFunction *> &active, std::vector<int> &saturated, std::vector<DLLCostFunction *> &dropped, 
+                           int numPoints, const double *x, double cost, Eigen::Vector4d &g, Eigen::Matrix4d &H)
+    {
+        // The weights of the last evaluation are the ones at x, the accepted step
+        _candidates.clear();
+        for(unsigned int i=0; i<active.size(); i++)
+        {
+            if(_weights[i] > _active_set_weight)
+                saturated[i] = 0;
+            else if(++saturated[i] >= _active_set_rounds)
+                _candidates.push_back(std::make_pair(_weights[i], (int)i));
+        }
+
+        // Drop the most saturated candidates, keeping at least the minimum active set
+        int drop = std::min((int)_candidates.size(), (int)active.size() - (int)(_active_set_min_ratio*numPoints));
+        if(drop <= 0)
+            return cost;
+        if(drop < (int)_candidates.size())
+            std::nth_element(_candidates.begin(), _candidates.begin()+drop, _candidates.end());
+        _removed.clear();
+        for(int k=0; k<drop; k++)
+        {
+            _removed.push_back(active[_candidates[k].second]);
+            active[_candidates[k].second] = NULL;
+        }
+
+        // Compact the active set, keeping the order of the points
+        unsigned int n = 0;
+        for(unsigned int i=0; i<active.size(); i++)
+        {
+            if(active[i] != NULL)
+            {
+                active[n] = active[i];
+                saturated[n++] = saturated[i];
+            }
+        }
+        active.resize(n);
+        saturated.resize(n);
+        dropped.insert(dropped.end(), _removed.begin(), _removed.end());
+
+        // Their last evaluation was at x, so this pass reuses the cached cells
+        Eigen::Vector4d gd;
+        Eigen::Matrix4d Hd;
+        cost -= evaluateNewton(_removed, x, gd, Hd);
+        g -= gd;
+        H -= Hd;
+        if(_planar)
+            H(2, 2) = 1.0;
+
+        return cost;
+    }
+
+    //! Move back to the active set the dropped points that are not saturated at x, adding their
+    //! terms to the cost, gradient and Hessian. Returns true if any point was restored
+    bool restoreActiveSet(std::vector<DLLCostFunction *> &active, std::vector<int> &saturated, std::vector<DLLCostFunction *> &dropped, 
+                          const double *x, double &cost, Eigen::Vector4d &g, Eigen::Matrix4d &H)
+    {
+        if(dropped.empty())
+            return false;
+        Eigen::Vector4d gd;
+        Eigen::Matrix4d Hd;
+        evaluateNewton(dropped, x, gd, Hd);
+        _removed.clear();
+        unsigned int n = 0;
+        for(unsigned int i=0; i<dropped.size(); i++)
+        {
+            if(_weights[i] > _active_set_weight)
+                _removed.push_back(dropped[i]);
+            else
+                dropped[n++] = dropped[i];
+        }
+        dropped.resize(n);
+        if(_removed.empty())
+            return false;
+
+        active.insert(active.end(), _removed.begin(), _removed.end());
+        saturated.resize(active.size(), 0);
+        cost += evaluateNewton(_removed, x, gd, Hd);
+        g += gd;
+        H += Hd;
+        if(_planar)
+            H(2, 2) = 1.0;
+
+        return true;
     }
 };
 
@@ -0,0 +1,57 @@
+#ifndef __DOUBLEBUFFER_HPP__
+#define __DOUBLEBUFFER_HPP__
+
+#include <atomic>
+#include <type_traits>
+
+// Lock-free exchange of a small value from one writer thread to readers in other threads.
+// The writer fills the slot not being published and then publishes it. The sequence number
+// is odd while a write is in progress and its half gives the published slot, so readers are
+// never blocked by a write into the other slot, and retry only if the writer started to
+// overwrite their own slot (two writes during a single copy).
+template<typename T>
+class DoubleBuffer
+{
+	static_assert(std::is_trivially_copyable<T>::value, "DoubleBuffer needs a trivially copyable type");
+
+public:
+
+	DoubleBuffer(void) : m_seq(0)
+	{
+	}
+
+	//! Publish a new value. Only one thread can write
+	void write(const T &value)
+	{
+		unsigned seq = m_seq.load(std::memory_order_relaxed);
+		m_seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		m_slots[((seq >> 1) + 1) & 1] = value;
+		m_seq.store(seq + 2, std::memory_order_release);
+	}
+
+	//! Copy the latest value. Returns false if nothing was written yet
+	bool read(T &value) const
+	{
+		unsigned seq, published;
+		do
+		{
+			seq = m_seq.load(std::memory_order_acquire);
+			published = seq & ~1u;
+			if(published == 0)
+				return false;
+			value = m_slots[(published >> 1) & 1];
+			std::atomic_thread_fence(std::memory_order_acquire);
+		}
+		while(m_seq.load(std::memory_order_relaxed) - published >= 3);  // The next write into this slot started
+
+		return true;
+	}
+
+protected:
+
+	std::atomic<unsigned> m_seq;
+	T m_slots[2];
+};
+
+#endif
@@ -14,6 +14,12 @@
 #include <nav_msgs/OccupancyGrid.h>
 #include <std_msgs/Float32.h>
 #include <stdio.h> 
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 
 // PCL
 #include <pcl/point_cloud.h>
@@ -24,20 +30,18 @@
 #include <pcl/registration/ndt.h>
 #include <pcl/filters/approximate_voxel_grid.h>
 
-struct TrilinearParams
-{
-	float a0, a1, a2, a3, a4, a5, a6, a7;
+#include "trilinear.hpp"
+#include "adf3d.hpp"
+#include "planargrid3d.hpp"
+#include "scancontext.hpp"
 
-	TrilinearParams(void)
-	{
-		a0 = a1 = a2 = a3 = a4 = a5 = a6 = a7 = 0.0;
-	}
+// Grid bundle file identification
+#define GRID_BUNDLE_MAGIC "DLLG"
+#define GRID_BUNDLE_VERSION 3
 
-	double interpolate(double x, double y, double z)
-	{
-		return a0 + a1*x + a2*y + a3*z + a4*x*y + a5*x*z + a6*y*z + a7*x*y*z;
-	}
-};
+// Grid cells encoding into the bundle
+#define GRID_ENCODING_RAW 0
+#define GRID_ENCODING_DELTA 1
 
 class Grid3d
 {
@@ -49,9 +53,12 @@ private:
 	std::string m_mapPath, m_nodeName;
 	std::string m_globalFrameId;
 	float m_sensorDev, m_gridSlice;
+	bool m_gridCompression;
+	float m_gridQuantization, m_gridTruncation, m_gridResolution;
 	double m_publishPointCloudRate, m_publishGridSliceRate;
 	
 	// Octomap parameters
+	float m_minX, m_minY, m_minZ;
 	float m_maxX, m_maxY, m_maxZ;
 	float m_resolution, m_oneDivRes;
 	octomap::OcTree *m_octomap;
@@ -68,8 +75,13 @@ private:
 		}
 	};
 	gridCell *m_grid;
-	int m_gridSize, m_gridSizeX, m_gridSizeY, m_gridSizeZ;
-	int m_gridStepY, m_gridStepZ;
+	int64_t m_gridSize;
+	int m_gridSizeX, m_gridSizeY, m_gridSizeZ;
+	int64_t m_gridStepY, m_gridStepZ;
+	
+	// 32-bit copies of the steps, used by point2grid when the grid fits into 32-bit indices
+	bool m_index32;
+	int m_gridStepY32, m_gridStepZ32;
 	
 	// 3D point clound representation of the map
 	pcl::PointCloud<pcl::PointXYZ>::Ptr m_cloud;
@@ -88,6 +100,15 @@ private:
 	// Trilinear approximation parameters (for each grid cell)
 	TrilinearParams *m_triGrid;
 
+	// Adaptively sampled version of the trilinear approximation, used instead of m_triGrid if enabled
+	bool m_useAdf;
+	float m_adfTolerance, m_adfRelTolerance;
+	int m_adfLevels;
+	Adf3d m_adf;
+
+	// Height band of the trilinear field for planar robots, replaces the full field if enabled
+	PlanarGrid3d m_planarGrid;
+
 	// ICP 
 	pcl::IterativeClosestPoint<pcl::PointXYZ, pcl::PointXYZ> m_icp;
 
@@ -115,38 +136,36 @@ public:
 		if(!lnh.getParam("publish_grid_slice_rate", m_publishGridSliceRate))
 			m_publishGridSliceRate = 0.2;
 		m_gridSlice = (float)value;
+		if(!lnh.getParam("use_adf", m_useAdf))
+			m_useAdf = false;
+		if(!lnh.getParam("adf_tolerance", value))
+			value = 0.01;
+		m_adfTolerance = (float)value;
+		if(!lnh.getParam("adf_relative_tolerance", value))
+			value = 0.05;
+		m_adfRelTolerance = (float)value;
+		if(!lnh.getParam("adf_levels", m_adfLevels))
+			m_adfLevels = 5;
 		if(!lnh.getParam("sensor_dev", value))
 			value = 0.2;
 		m_sensorDev = (float)value;
+		if(!lnh.getParam("grid_compression", m_gridCompression))
+			m_gridCompression = true;
+		if(!lnh.getParam("grid_quantization", value))
+			value = 0.0001;
+		m_gridQuantization = (float)value;
+		if(!lnh.getParam("grid_truncation", value))
+			value = -1.0;
+		m_gridTruncation = (float)value;
+		if(!lnh.getParam("grid_resolution", value))
+			value = -1.0;
+		m_gridResolution = (float)value;
 		
-		// Load octomap 
+		// Load the map, directly from the grid bundle if it is available 
 		m_octomap = NULL;
 		m_grid = NULL;
-		if(loadOctomap(m_mapPath))
+		if(loadMap(m_mapPath))
 		{
-			// Compute the point-cloud associated to the ocotmap
-			computePointCloud(); //以m_octomap的(minX,minY,minZ)为(0,0,0)坐标原点，对于m_octomap中每个occupancied叶子节点，
-			//计算在该坐标系下的point，保存在m_cloud中。
-			
-			// Try to load tha associated grid-map from file
-			std::string path;
-			if(m_mapPath.compare(m_mapPath.length()-3, 3, ".bt") == 0)
-				path = m_mapPath.substr(0,m_mapPath.find(".bt"))+".grid";
-			if(m_mapPath.compare(m_mapPath.length()-3, 3, ".ot") == 0)
-				path = m_mapPath.substr(0,m_mapPath.find(".ot"))+".grid";
-			if(!loadGrid(path))
-			{						
-				// Compute the gridMap using kdtree search over the point-cloud
-				std::cout << "Computing 3D occupancy grid. This will take some time..." << std::endl;
-				computeGrid(); //按照octomap的分辨率(每米分为几个格子)，index依次按照X,Y,Z, 从小到大，
-				               //m_grid[index]: 距离该格子最近的地图点到该格子的距离，和该点为最近点的概率。
-				std::cout << "\tdone!" << std::endl;
-				
-				// Save grid on file
-				if(saveGrid(path))
-					std::cout << "Grid map successfully saved on " << path << std::endl;
-			}
-			
 			// Build the msg with a slice of the grid if needed
 			if(m_gridSlice >= 0 && m_gridSlice <= m_maxZ)//默认不会执行
 			{
@@ -175,7 +194,7 @@ public:
 		m_ndt.setMaximumIterations (50);   // Setting max number of registration iterations.
 	}
 
-	Grid3d(std::string &node_name, std::string &map_path) : m_cloud(new pcl::PointCloud<pcl::PointXYZ>), m_triGrid(NULL)
+	Grid3d(std::string &node_name, std::string &map_path) : m_cloud(new pcl::PointCloud<pcl::PointXYZ>), m_triGrid(NULL), m_useAdf(false)
 	{
 	  
 		// Load paraeters
@@ -186,34 +205,23 @@ public:
 		if(!lnh.getParam("sensor_dev", value))
 			value = 0.2;
 		m_sensorDev = (float)value;
+		if(!lnh.getParam("grid_compression", m_gridCompression))
+			m_gridCompression = true;
+		if(!lnh.getParam("grid_quantization", value))
+			value = 0.0001;
+		m_gridQuantization = (float)value;
+		if(!lnh.getParam("grid_truncation", value))
+			value = -1.0;
+		m_gridTruncation = (float)value;
+		if(!lnh.getParam("grid_resolution", value))
+			value = -1.0;
+		m_gridResolution = (float)value;
 		m_mapPath = map_path;
 		// Load octomap 
 		m_octomap = NULL;
 		m_grid = NULL;
 		
-		if(loadOctomap(m_mapPath))
-		{
-			// Compute the point-cloud associated to the ocotmap
-			computePointCloud();
-			
-			// Try to load tha associated grid-map from file
-			std::string path;
-			if(m_mapPath.compare(m_mapPath.length()-3, 3, ".bt") == 0)
-				path = m_mapPath.substr(0,m_mapPath.find(".bt"))+".grid";
-			if(m_mapPath.compare(m_mapPath.length()-3, 3, ".ot") == 0)
-				path = m_mapPath.substr(0,m_mapPath.find(".ot"))+".grid";
-			if(!loadGrid(path))
-			{						
-				// Compute the gridMap using kdtree search over the point-cloud
-				std::cout << "Computing 3D occupancy grid. This will take some time..." << std::endl;
-				computeGrid();
-				std::cout << "\tdone!" << std::endl;
-				
-				// Save grid on file
-				if(saveGrid(path))
-					std::cout << "Grid map successfully saved on " << path << std::endl;
-			}			
-		}
+		loadMap(m_mapPath);
 
 		// Setup ICP
 		m_icp.setMaximumIterations (50);
@@ -227,6 +235,18 @@ public:
 		m_ndt.setMaximumIterations (50);   // Setting max number of registration iterations.
 	}
 
+	//! Empty grid for the offline generation stages (see generateLoad/Grid/Save), nothing is loaded
+	Grid3d(float sensorDev, float resolution, float truncation, bool compression, float quantization) : m_cloud(new pcl::PointCloud<pcl::PointXYZ>), m_triGrid(NULL), m_useAdf(false)
+	{
+		m_sensorDev = sensorDev;
+		m_gridResolution = resolution;
+		m_gridTruncation = truncation;
+		m_gridCompression = compression;
+		m_gridQuantization = quantization;
+		m_octomap = NULL;
+		m_grid = NULL;
+	}
+
 	~Grid3d(void)
 	{
 		if(m_octomap != NULL)
@@ -237,6 +257,150 @@ public:
 			delete []m_triGrid;
 	}
 
+	//! Offline generation stage 1: parse the octomap and extract the occupied voxels
+	bool generateLoad(std::string &mapPath)
+	{
+		m_mapPath = mapPath;
+		if(!loadOctomap(m_mapPath))
+			return false;
+		computePointCloud();
+
+		// The octomap is not needed anymore, release it to keep memory low along the pipeline
+		delete m_octomap;
+		m_octomap = NULL;
+
+		return true;
+	}
+
+	//! Offline generation stage 2: compute the distance grid from the occupied voxels
+	void generateGrid(void)
+	{
+		computeGrid();
+	}
+
+	//! Offline generation stage 3: encode and write the grid bundle
+	bool generateSave(std::string &path)
+	{
+		return saveGrid(path);
+	}
+
+	//! Offline generation stage 4: place recognition descriptors of virtual scans rendered every 
+	//! step meters over the map, height meters above the lowest occupied voxel of each column
+	bool generateDescriptors(std::string &path, float step, float height, float maxRange)
+	{
+		// Sample the poses
+		std::vector<ScanContext::Entry> entries;
+		for(float y=0.5*step; y<m_maxY; y+=step)
+		{
+			for(float x=0.5*step; x<m_maxX; x+=step)
+			{
+				ScanContext::Entry e;
+				e.x = x;
+				e.y = y;
+				e.z = -1.0;
+				int ix = (int)(x*m_oneDivRes), iy = (int)(y*m_oneDivRes);
+				for(int iz=0; iz<m_gridSizeZ && e.z < 0; iz++)
+					if(m_grid[ix + iy*m_gridStepY + iz*m_gridStepZ].dist >= 0 && 
+					   m_grid[ix + iy*m_gridStepY + iz*m_gridStepZ].dist <= m_resolution*m_resolution)
+						e.z = iz*m_resolution + height;
+				if(e.z >= 0 && e.z < m_maxZ && getPointDist(e.x, e.y, e.z) > 0.25*height*height)
+					entries.push_back(e);
+			}
+		}
+
+		// Render a 32 beams lidar with 1 degree azimuth resolution at each pose
+		std::cout << "Computing " << entries.size() << " place recognition descriptors..." << std::endl;
+		ScanContext sc(maxRange);
+		std::vector<float> dx, dy, dz;
+		getLidarRays(32, -25.0, 15.0, 360, dx, dy, dz);
+		parallelFor(entries.size(), [&](int i)
+		{
+			ScanContext::Entry &e = entries[i];
+			std::vector<pcl::PointXYZ> scan;
+			renderScan(e.x, e.y, e.z, 0.0, dx, dy, dz, maxRange, scan, false);
+			sc.compute(scan, e.key, e.desc);
+		});
+		for(size_t i=0; i<entries.size(); i++)
+			sc.add(entries[i]);
+
+		return sc.save(path);
+	}
+
+	//! Unit directions of a lidar with numBeams rings evenly spread between the elevations (degrees)
+	//! and numColumns azimuths per ring, ring by ring
+	static void getLidarRays(int numBeams, float minElevation, float maxElevation, int numColumns, 
+							 std::vector<float> &dx, std::vector<float> &dy, std::vector<float> &dz)
+	{
+		dx.resize(numBeams*numColumns);
+		dy.resize(numBeams*numColumns);
+		dz.resize(numBeams*numColumns);
+		for(int beam=0; beam<numBeams; beam++)
+		{
+			float elevation = (minElevation + (numBeams > 1 ? beam*(maxElevation-minElevation)/(numBeams-1) : 0.0))*M_PI/180.0;
+			for(int col=0; col<numColumns; col++)
+			{
+				float azimuth = col*2*M_PI/numColumns;
+				dx[beam*numColumns + col] = cos(elevation)*cos(azimuth);
+				dy[beam*numColumns + col] = cos(elevation)*sin(azimuth);
+				dz[beam*numColumns + col] = sin(elevation);
+			}
+		}
+	}
+
+	//! Simulated scan from the pose, with the ray directions given in the sensor frame. The hits 
+	//! are returned in the sensor frame (rotated by yaw only)
+	void renderScan(float x, float y, float z, float yaw, const std::vector<float> &dx, const std::vector<float> &dy, 
+					const std::vector<float> &dz, float maxRange, std::vector<pcl::PointXYZ> &scan, bool parallel = true)
+	{
+		int n = dx.size();
+		float ca = cos(yaw), sa = sin(yaw);
+		std::vector<float> wx(n), wy(n), ranges(n);
+		for(int i=0; i<n; i++)
+		{
+			wx[i] = ca*dx[i] - sa*dy[i];
+			wy[i] = sa*dx[i] + ca*dy[i];
+		}
+		castRays(x, y, z, &wx[0], &wy[0], &dz[0], n, maxRange, &ranges[0], parallel);
+		scan.clear();
+		for(int i=0; i<n; i++)
+			if(ranges[i] > 0)
+				scan.push_back(pcl::PointXYZ(ranges[i]*dx[i], ranges[i]*dy[i], ranges[i]*dz[i]));
+	}
+
+	//! Distance along the ray to the first occupied voxel, or -1 if there is none before maxRange 
+	//! or the ray leaves the map
+	float castRay(float x, float y, float z, float dx, float dy, float dz, float maxRange)
+	{
+		float range;
+		castRayPacket(x, y, z, &dx, &dy, &dz, 1, maxRange, &range);
+		return range;
+	}
+
+	//! castRay for n rays from the same origin, in packets of RAY_PACKET rays distributed among the cores
+	void castRays(float x, float y, float z, const float *dx, const float *dy, const float *dz, int n, 
+				  float maxRange, float *ranges, bool parallel = true)
+	{
+		int numPackets = (n + RAY_PACKET - 1)/RAY_PACKET;
+		auto cast = [&](int i) 
+		{
+			int k = i*RAY_PACKET;
+			castRayPacket(x, y, z, dx+k, dy+k, dz+k, std::min(RAY_PACKET, n-k), maxRange, ranges+k);
+		};
+		if(parallel)
+		{
+			// Blocks of consecutive packets, neighbour rays visit the same voxels
+			int numBlocks = (numPackets + 63)/64;
+			parallelFor(numBlocks, [&](int b) 
+			{
+				for(int i=b*64; i<std::min(numPackets, (b+1)*64); i++)
+					cast(i);
+			});
+		}
+		else
+			for(int i=0; i<numPackets; i++)
+				cast(i);
+	}
+
 	float computeCloudWeight(std::vector<pcl::PointXYZ> &points)
 	{
 		float weight = 0.;
@@ -247,8 +411,7 @@ public:
 			const pcl::PointXYZ& p = points[i];
 			if(p.x >= 0.0 && p.y >= 0.0 && p.z >= 0.0 && p.x < m_maxX && p.y < m_maxY && p.z < m_maxZ)
 			{
-				int index = point2grid(p.x, p.y, p.z);
-				weight += m_grid[index].prob;
+				weight += getGridProb(p.x, p.y, p.z);
 				n++;
 			}
 		}
@@ -278,24 +441,129 @@ public:
 
 	double getPointDist(double x, double y, double z)
 	{
-		return m_grid[point2grid(x, y, z)].dist;
+		return getGridDist(x, y, z);
 	}
 
 	double getPointDistProb(double x, double y, double z)
 	{
-		return m_grid[point2grid(x, y, z)].prob;
+		return getGridProb(x, y, z);
+	}
+
+	//! Distance grid value of the voxel of a point into the map. Once the distance grid is
+	//! released, the adaptive field is evaluated at the voxel corner, where the grid was sampled
+	inline float getGridDist(float x, float y, float z)
+	{
+		if(m_grid != NULL)
+			return m_grid[point2grid(x, y, z)].dist;
+		x = (int)(x*m_oneDivRes)*m_resolution;
+		y = (int)(y*m_oneDivRes)*m_resolution;
+		z = (int)(z*m_oneDivRes)*m_resolution;
+		TrilinearParams p = m_adf.lookup(x, y, z);
+		return p.interpolate(x, y, z);
+	}
+
+	//! Probability grid value of the voxel of a point into the map, a function of its distance
+	inline float getGridProb(float x, float y, float z)
+	{
+		if(m_grid != NULL)
+			return m_grid[point2grid(x, y, z)].prob;
+		return dist2prob(getGridDist(x, y, z));
+	}
+
+	//! Probability of the given grid distance, as computed into the grid
+	inline float dist2prob(float dist)
+	{
+		float gaussConst1 = 1./(m_sensorDev*sqrt(2*M_PI));
+		float gaussConst2 = 1./(2*m_sensorDev*m_sensorDev);
+		return gaussConst1*exp(-dist*dist*gaussConst2);
+	}
+
+	float getResolution(void)
+	{
+		return m_resolution;
+	}
+
+	//! Box [min, max) around the point where getPointDistInterpolation returns the same parameters:
+	//! its voxel inside the map, or the half space past the first bound it crosses outside the map
+	inline void getPointVoxelBounds(double x, double y, double z, float *min, float *max)
+	{
+		const double p[3] = {x, y, z};
+		const float bound[3] = {m_maxX, m_maxY, m_maxZ};
+		for(int i=0; i<3; i++)
+		{
+			min[i] = -INFINITY;
+			max[i] = INFINITY;
+		}
+		for(int i=0; i<3; i++)
+		{
+			if(p[i] < 0.0)
+			{
+				max[i] = 0.0;
+				return;
+			}
+			if(p[i] >= bound[i])
+			{
+				min[i] = bound[i];
+				return;
+			}
+		}
+		for(int i=0; i<3; i++)
+		{
+			min[i] = (int)((float)p[i]*m_oneDivRes)*m_resolution;
+			max[i] = std::min(min[i] + m_resolution, bound[i]);
+		}
+	}
+
+	//! Prefetch the trilinear parameters that getPointDistInterpolation will read for the point
+	inline void prefetchPointDistInterpolation(double x, double y, double z)
+	{
+		if(x >= 0.0 && y >= 0.0 && z >= 0.0 && x < m_maxX && y < m_maxY && z < m_maxZ)
+		{
+			const TrilinearParams *l;
+			if(m_planarGrid.isEnabled())
+			{
+				if((l = m_planarGrid.get((int)(x*m_oneDivRes), (int)(y*m_oneDivRes), (int)(z*m_oneDivRes))) != NULL)
+					__builtin_prefetch(l);
+			}
+			else if(!m_useAdf)
+				__builtin_prefetch(&m_triGrid[point2grid(x, y, z)]);
+		}
 	}
 
 	TrilinearParams getPointDistInterpolation(double x, double y, double z)
 	{
 		TrilinearParams r;
 		if(x >= 0.0 && y >= 0.0 && z >= 0.0 && x < m_maxX && y < m_maxY && z < m_maxZ)
-			r = m_triGrid[point2grid(x, y, z)];
+		{
+			const TrilinearParams *l;
+			if(m_planarGrid.isEnabled())
+			{
+				if((l = m_planarGrid.get((int)(x*m_oneDivRes), (int)(y*m_oneDivRes), (int)(z*m_oneDivRes))) != NULL)
+					r = *l;
+			}
+			else if(m_useAdf)
+				r = m_adf.lookup(x, y, z);
+			else
+				r = m_triGrid[point2grid(x, y, z)];
+		}
 		return r;
 	}
 
 	bool computeTrilinearInterpolation(void)
 	{
+		if(m_useAdf)
+		{
+			// The adaptive field replaces the distance grid too, which is released
+			if(computeAdf())
+			{
+				delete []m_grid;
+				m_grid = NULL;
+				return true;
+			}
+			std::cout << "Too many cells for the adaptive field, using the dense one" << std::endl;
+			m_useAdf = false;
+		}
+
 		// Delete existing parameters if the exists
 		if(m_triGrid != NULL)
 			delete []m_triGrid;
@@ -306,9 +574,8 @@ public:
 		// Compute the distance to the closest point of the grid
 		int ix, iy, iz;
 		double count = 0.0;
-		double size = m_gridSizeX*m_gridSizeY*m_gridSizeZ;
+		double size = m_gridSize;
 		double x0, y0, z0, x1, y1, z1;
-		double div = -1.0/(m_resolution*m_resolution*m_resolution);
 		for(iz=0, z0=0.0, z1=m_resolution; iz<m_gridSizeZ-1; iz++, z0+=m_resolution, z1+=m_resolution)
 		{
 			printf("Computing trilinear interpolation map: : %3.2lf%%        \r", count/size * 100.0);
@@ -316,36 +583,18 @@ public:
 			{
 				for(ix=0, x0=0.0, x1=m_resolution; ix<m_gridSizeX-1; ix++, x0+=m_resolution, x1+=m_resolution)
 				{
-					double c000, c001, c010, c011, c100, c101, c110, c111;
 					TrilinearParams p;
 					count++;
                     
-					//见https://en.wikipedia.org/wiki/Trilinear_interpolation
-					c000 = m_grid[(ix+0) + (iy+0)*m_gridStepY + (iz+0)*m_gridStepZ].dist;
-					c001 = m_grid[(ix+0) + (iy+0)*m_gridStepY + (iz+1)*m_gridStepZ].dist;
-					c010 = m_grid[(ix+0) + (iy+1)*m_gridStepY + (iz+0)*m_gridStepZ].dist;
-					c011 = m_grid[(ix+0) + (iy+1)*m_gridStepY + (iz+1)*m_gridStepZ].dist;
-					c100 = m_grid[(ix+1) + (iy+0)*m_gridStepY + (iz+0)*m_gridStepZ].dist;
-					c101 = m_grid[(ix+1) + (iy+0)*m_gridStepY + (iz+1)*m_gridStepZ].dist;
-					c110 = m_grid[(ix+1) + (iy+1)*m_gridStepY + (iz+0)*m_gridStepZ].dist;
-					c111 = m_grid[(ix+1) + (iy+1)*m_gridStepY + (iz+1)*m_gridStepZ].dist;
-					
-					p.a0 = (-c000*x1*y1*z1 + c001*x1*y1*z0 + c010*x1*y0*z1 - c011*x1*y0*z0 
-					+ c100*x0*y1*z1 - c101*x0*y1*z0 - c110*x0*y0*z1 + c111*x0*y0*z0)*div;
-					p.a1 = (c000*y1*z1 - c001*y1*z0 - c010*y0*z1 + c011*y0*z0
-					- c100*y1*z1 + c101*y1*z0 + c110*y0*z1 - c111*y0*z0)*div;
-					p.a2 = (c000*x1*z1 - c001*x1*z0 - c010*x1*z1 + c011*x1*z0 
-					- c100*x0*z1 + c101*x0*z0 + c110*x0*z1 - c111*x0*z0)*div;
-					p.a3 = (c000*x1*y1 - c001*x1*y1 - c010*x1*y0 + c011*x1*y0 
-					- c100*x0*y1 + c101*x0*y1 + c110*x0*y0 - c111*x0*y0)*div;
-					p.a4 = (-c000*z1 + c001*z0 + c010*z1 - c011*z0 + c100*z1 
-					- c101*z0 - c110*z1 + c111*z0)*div;
-					p.a5 = (-c000*y1 + c001*y1 + c010*y0 - c011*y0 + c100*y1 
-					- c101*y1 - c110*y0 + c111*y0)*div;
-					p.a6 = (-c000*x1 + c001*x1 + c010*x1 - c011*x1 + c100*x0 
-					- c101*x0 - c110*x0 + c111*x0)*div;
-					p.a7 = (c000 - c001 - c010 + c011 - c100
-					+ c101 + c110 - c111)*div;
+					p.compute(m_grid[(ix+0) + (iy+0)*m_gridStepY + (iz+0)*m_gridStepZ].dist,
+							  m_grid[(ix+0) + (iy+0)*m_gridStepY + (iz+1)*m_gridStepZ].dist,
+							  m_grid[(ix+0) + (iy+1)*m_gridStepY + (iz+0)*m_gridStepZ].dist,
+							  m_grid[(ix+0) + (iy+1)*m_gridStepY + (iz+1)*m_gridStepZ].dist,
+							  m_grid[(ix+1) + (iy+0)*m_gridStepY + (iz+0)*m_gridStepZ].dist,
+							  m_grid[(ix+1) + (iy+0)*m_gridStepY + (iz+1)*m_gridStepZ].dist,
+							  m_grid[(ix+1) + (iy+1)*m_gridStepY + (iz+0)*m_gridStepZ].dist,
+							  m_grid[(ix+1) + (iy+1)*m_gridStepY + (iz+1)*m_gridStepZ].dist,
+							  x0, y0, z0, x1, y1, z1);
 
 					m_triGrid[ix + iy*m_gridStepY + iz*m_gridStepZ] = p;
 				}
@@ -356,6 +605,54 @@ public:
 		return true;
 	}
 
+	//! Keep only the band of the field between the given heights and release the full one. 
+	//! Points out of the band have zero residual and gradient afterwards. Must be called after 
+	//! computeTrilinearInterpolation
+	bool setupPlanarField(double minZ, double maxZ)
+	{
+		int iz0 = std::max(0, (int)floor(minZ*m_oneDivRes));
+		int iz1 = std::min(m_gridSizeZ-1, (int)ceil(maxZ*m_oneDivRes));
+		if(iz1 < iz0)
+			return false;
+		m_planarGrid.init(m_gridSizeX, m_gridSizeY, iz0, iz1-iz0+1);
+		auto fetch = [this](int ix, int iy, int iz) 
+		{
+			if(m_useAdf)
+				return m_adf.lookup((ix+0.5)*m_resolution, (iy+0.5)*m_resolution, (iz+0.5)*m_resolution);
+			return m_triGrid[ix + iy*m_gridStepY + iz*m_gridStepZ];
+		};
+		parallelFor(m_gridSizeY, [&](int iy) { m_planarGrid.buildRow(iy, fetch); });
+		std::cout << "Planar field: " << iz1-iz0+1 << " layers from z = " << iz0*m_resolution << ", " 
+				  << m_planarGrid.getMemorySize()/1048576.0 << " MB (full: " << m_gridSize*sizeof(TrilinearParams)/1048576.0 << " MB)" << std::endl;
+
+		// The band replaces the full field. The adaptive field still answers the distance 
+		// queries if the distance grid was released
+		if(m_triGrid != NULL)
+			delete []m_triGrid;
+		m_triGrid = NULL;
+		if(m_grid != NULL)
+			m_adf = Adf3d();
+		m_useAdf = false;
+
+		return true;
+	}
+
+	//! Build the adaptively sampled trilinear field from the distance grid
+	bool computeAdf(void)
+	{
+		std::cout << "Computing adaptive trilinear interpolation map..." << std::endl;
+		auto dist = [this](int ix, int iy, int iz) { return m_grid[ix + iy*m_gridStepY + iz*m_gridStepZ].dist; };
+		m_adf.init(m_gridSizeX, m_gridSizeY, m_gridSizeZ, m_resolution, m_adfLevels, m_adfTolerance, m_adfRelTolerance);
+		parallelFor(m_adf.getNumBricks(), [&](int b) { m_adf.buildBrick(b, dist); });
+		if(!m_adf.finish())
+			return false;
+		// The dense field would keep the distance and probability grid too
+		std::cout << "\tdone! " << m_adf.getNumLeaves() << " leaves, " << m_adf.getMemorySize()/1048576.0 << " MB (dense with the distance grid: " 
+				  << m_gridSize*(sizeof(TrilinearParams) + sizeof(gridCell))/1048576.0 << " MB)" << std::endl;
+
+		return true;
+	}
+
 	bool alignICP(std::vector<pcl::PointXYZ> &p, double &tx, double &ty, double &tz, double &a)
 	{
 		pcl::PointCloud<pcl::PointXYZ>::Ptr c (new pcl::PointCloud<pcl::PointXYZ>);
@@ -433,6 +730,62 @@ public:
 		return true;
 	}
 
+	//! Exhaustive search of the pose that maximizes the summed probability of the points, over a
+	//! window of +-linearWindow meters in x, y and +-angularWindow radians in yaw around the given
+	//! pose. Height is kept. Yaw candidates are distributed among the cores. Returns the best score
+	float alignCorrelative(std::vector<pcl::PointXYZ> &p, double &tx, double &ty, double tz, double &a, 
+						   double linearWindow, double angularWindow, double linearStep, double angularStep)
+	{
+		int nl = (int)(linearWindow/linearStep), na = (int)(angularWindow/angularStep);
+		int numYaw = 2*na+1;
+		std::vector<float> bestScore(numYaw, -1.0);
+		std::vector<int> bestX(numYaw, 0), bestY(numYaw, 0);
+		parallelFor(numYaw, [&](int k)
+		{
+			// Rotate the scan once per yaw, then sweep the translations
+			double yaw = a + (k-na)*angularStep, ca = cos(yaw), sa = sin(yaw);
+			std::vector<float> rx(p.size()), ry(p.size()), rz(p.size());
+			for(size_t i=0; i<p.size(); i++)
+			{
+				rx[i] = ca*p[i].x - sa*p[i].y + tx;
+				ry[i] = sa*p[i].x + ca*p[i].y + ty;
+				rz[i] = p[i].z + tz;
+			}
+			for(int iy=-nl; iy<=nl; iy++)
+			{
+				for(int ix=-nl; ix<=nl; ix++)
+				{
+					float dx = ix*linearStep, dy = iy*linearStep, score = 0.0;
+					for(size_t i=0; i<p.size(); i++)
+					{
+						float x = rx[i] + dx, y = ry[i] + dy;
+						if(x >= 0.0 && y >= 0.0 && rz[i] >= 0.0 && x < m_maxX && y < m_maxY && rz[i] < m_maxZ)
+							score += getGridProb(x, y, rz[i]);
+					}
+					if(score > bestScore[k])
+					{
+						bestScore[k] = score;
+						bestX[k] = ix;
+						bestY[k] = iy;
+					}
+				}
+			}
+		});
+
+		// Best yaw, closest to the initial one on ties
+		int best = na;
+		for(int k=0; k<numYaw; k++)
+			if(bestScore[k] > bestScore[best] || (bestScore[k] == bestScore[best] && abs(k-na) < abs(best-na)))
+				best = k;
+		if(bestScore[best] <= 0.0)
+			return 0.0;
+		tx += bestX[best]*linearStep;
+		ty += bestY[best]*linearStep;
+		a += (best-na)*angularStep;
+
+		return p.size() > 0 ? bestScore[best]/p.size() : 0.0;
+	}
+
 protected:
 
 	void publishMapPointCloudTimer(const ros::TimerEvent& event)
@@ -445,6 +798,52 @@ protected:
 		publishGridSlice();
 	}
 
+	//! Get the path of the grid bundle associated to a map (.bt, .ot or directly a .grid)
+	std::string getGridPath(std::string &mapPath)
+	{
+		if(mapPath.length() > 3 && (mapPath.compare(mapPath.length()-3, 3, ".bt") == 0 || mapPath.compare(mapPath.length()-3, 3, ".ot") == 0))
+			return mapPath.substr(0, mapPath.length()-3)+".grid";
+		return mapPath;
+	}
+
+	//! Load the grid bundle if it exists, otherwise load the octomap and compute (and save) the grid
+	bool loadMap(std::string &mapPath)
+	{
+		// The grid bundle is self-contained, so the octomap is not needed at all
+		std::string path = getGridPath(mapPath);
+		if(loadGridBundle(path))
+		{
+			if(m_gridResolution <= 0 || fabs(m_resolution-m_gridResolution) < 1e-6)
+			{
+				std::cout << "Grid bundle loaded from " << path << ", skipping octomap" << std::endl;
+				return true;
+			}
+			std::cout << "Grid bundle resolution " << m_resolution << " differs from grid_resolution " << m_gridResolution << ", recomputing" << std::endl;
+		}
+		if(!loadOctomap(mapPath))
+			return false;
+
+		// Compute the point-cloud associated to the ocotmap
+		computePointCloud(); //以m_octomap的(minX,minY,minZ)为(0,0,0)坐标原点，对于m_octomap中每个occupancied叶子节点，
+		//计算在该坐标系下的point，保存在m_cloud中。
+		
+		// Try to load the legacy grid-map from file, otherwise compute it
+		if(!loadGrid(path))
+		{						
+			// Compute the gridMap using kdtree search over the point-cloud
+			std::cout << "Computing 3D occupancy grid. This will take some time..." << std::endl;
+			computeGrid(); //按照octomap的分辨率(每米分为几个格子)，index依次按照X,Y,Z, 从小到大，
+						   //m_grid[index]: 距离该格子最近的地图点到该格子的距离，和该点为最近点的概率。
+			std::cout << "\tdone!" << std::endl;
+		}
+		
+		// Save grid on file as a bundle for fast loading in future executions
+		if(saveGrid(path))
+			std::cout << "Grid map successfully saved on " << path << std::endl;
+
+		return true;
+	}
+
 	bool loadOctomap(std::string &path)
 	{
 		// release previously loaded data
@@ -452,6 +851,8 @@ protected:
 			delete m_octomap;
 		if(m_grid != NULL)
 			delete []m_grid;
+		m_octomap = NULL;
+		m_grid = NULL;
 		
 		// Load octomap
 		octomap::AbstractOcTree *tree;
@@ -492,18 +893,28 @@ protected:
 		m_octomap->getMetricMin(minX, minY, minZ);
 		m_octomap->getMetricMax(maxX, maxY, maxZ);
 		res = m_octomap->getResolution();
+		m_minX = (float)minX;
+		m_minY = (float)minY;
+		m_minZ = (float)minZ;
 		m_maxX = (float)(maxX-minX);
 		m_maxY = (float)(maxY-minY);
 		m_maxZ = (float)(maxZ-minZ);
-		m_resolution = (float)res;
+		m_resolution = m_gridResolution > 0 ? m_gridResolution : (float)res; // Distance field resolution
 		m_oneDivRes = 1.0/m_resolution;
-		std::cout << "Map size:\n\tx: " << minX << " to " << maxX << std::endl;
-		std::cout << "\ty: " << minY << " to " << maxY << std::endl;
-		std::cout << "\tz: " << minZ << " to " << maxZ << std::endl;
-		std::cout << "\tRes: " << m_resolution << std::endl;
+		printMapInfo();
 		
 		return true;
 	}
+
+	void printMapInfo(void)
+	{
+		if(m_octomap != NULL)
+			std::cout << "Octomap res: " << m_octomap->getResolution() << std::endl;
+		std::cout << "Map size:\n\tx: " << m_minX << " to " << m_minX+m_maxX << std::endl;
+		std::cout << "\ty: " << m_minY << " to " << m_minY+m_maxY << std::endl;
+		std::cout << "\tz: " << m_minZ << " to " << m_minZ+m_maxZ << std::endl;
+		std::cout << "\tRes: " << m_resolution << std::endl;
+	}
 	
 	bool saveGrid(std::string &fileName)
 	{
@@ -517,15 +928,38 @@ protected:
 			return false;
 		}
 		
+		// Write bundle header: map bounds and resolution, so the octomap is not needed for loading
+		int version = GRID_BUNDLE_VERSION;
+		int numPoints = (int)m_cloud->points.size();
+		fwrite(GRID_BUNDLE_MAGIC, 1, 4, pf);
+		fwrite(&version, sizeof(int), 1, pf);
+		fwrite(&m_minX, sizeof(float), 1, pf);
+		fwrite(&m_minY, sizeof(float), 1, pf);
+		fwrite(&m_minZ, sizeof(float), 1, pf);
+		fwrite(&m_maxX, sizeof(float), 1, pf);
+		fwrite(&m_maxY, sizeof(float), 1, pf);
+		fwrite(&m_maxZ, sizeof(float), 1, pf);
+		fwrite(&m_resolution, sizeof(float), 1, pf);
+		fwrite(&numPoints, sizeof(int), 1, pf);
+
 		// Write grid general info 
-		fwrite(&m_gridSize, sizeof(int), 1, pf);
+		fwrite(&m_gridSize, sizeof(int64_t), 1, pf);
 		fwrite(&m_gridSizeX, sizeof(int), 1, pf);
 		fwrite(&m_gridSizeY, sizeof(int), 1, pf);
 		fwrite(&m_gridSizeZ, sizeof(int), 1, pf);
 		fwrite(&m_sensorDev, sizeof(float), 1, pf);
 		
 		// Write grid cells
-		fwrite(m_grid, sizeof(gridCell), m_gridSize, pf);
+		int encoding = m_gridCompression ? GRID_ENCODING_DELTA : GRID_ENCODING_RAW;
+		fwrite(&encoding, sizeof(int), 1, pf);
+		if(encoding == GRID_ENCODING_DELTA)
+			writeDeltaCells(pf);
+		else
+			fwrite(m_grid, sizeof(gridCell), m_gridSize, pf);
+
+		// Write the occupied voxels of the map (already shifted to the grid origin)
+		for(int i=0; i<numPoints; i++)
+			fwrite(m_cloud->points[i].data, sizeof(float), 3, pf);
 		
 		// Close file
 		fclose(pf);
@@ -533,6 +967,7 @@ protected:
 		return true;
 	}
 	
+	//! Load a legacy grid file (no header), map bounds must be already known from the octomap
 	bool loadGrid(std::string &fileName)
 	{
 		FILE *pf;
@@ -544,27 +979,319 @@ protected:
 			std::cout << "Error opening file " << fileName << " for reading" << std::endl;
 			return false;
 		}
+
+		// Bundles are handled by loadGridBundle
+		char magic[4];
+		if(fread(magic, 1, 4, pf) != 4 || memcmp(magic, GRID_BUNDLE_MAGIC, 4) == 0)
+		{
+			fclose(pf);
+			return false;
+		}
+		rewind(pf);
 		
-		// Write grid general info 
-		fread(&m_gridSize, sizeof(int), 1, pf);
-		fread(&m_gridSizeX, sizeof(int), 1, pf);
-		fread(&m_gridSizeY, sizeof(int), 1, pf);
-		fread(&m_gridSizeZ, sizeof(int), 1, pf);
-		fread(&m_sensorDev, sizeof(float), 1, pf);
-		m_gridStepY = m_gridSizeX;
-		m_gridStepZ = m_gridSizeX*m_gridSizeY;
-		
-		// Write grid cells
-		if(m_grid != NULL)
-			delete []m_grid;
-		m_grid = new gridCell[m_gridSize];
-		fread(m_grid, sizeof(gridCell), m_gridSize, pf);
+		// Read grid general info 
+		if(!readGridData(pf, 0))
+		{
+			std::cout << "Error reading grid file " << fileName << std::endl;
+			fclose(pf);
+			return false;
+		}
+
+		// The grid must match the current field resolution
+		if(m_gridSizeX != (int)(m_maxX*m_oneDivRes) || m_gridSizeY != (int)(m_maxY*m_oneDivRes) || m_gridSizeZ != (int)(m_maxZ*m_oneDivRes))
+		{
+			std::cout << "Grid file " << fileName << " does not match the field resolution" << std::endl;
+			fclose(pf);
+			return false;
+		}
+		setGridBounds();
 		
 		// Close file
 		fclose(pf);
 		
 		return true;
 	}
+
+	//! Load a self-contained grid bundle, without loading the octomap
+	bool loadGridBundle(std::string &fileName)
+	{
+		FILE *pf;
+		
+		// Open file
+		pf = fopen(fileName.c_str(), "rb");
+		if(pf == NULL)
+			return false;
+
+		// Check the bundle header
+		char magic[4];
+		int version, numPoints;
+		if(fread(magic, 1, 4, pf) != 4 || memcmp(magic, GRID_BUNDLE_MAGIC, 4) != 0 ||
+		   fread(&version, sizeof(int), 1, pf) != 1 || version < 1 || version > GRID_BUNDLE_VERSION)
+		{
+			fclose(pf);
+			return false;
+		}
+
+		// Read map bounds and resolution
+		bool ok = true;
+		ok &= fread(&m_minX, sizeof(float), 1, pf) == 1;
+		ok &= fread(&m_minY, sizeof(float), 1, pf) == 1;
+		ok &= fread(&m_minZ, sizeof(float), 1, pf) == 1;
+		ok &= fread(&m_maxX, sizeof(float), 1, pf) == 1;
+		ok &= fread(&m_maxY, sizeof(float), 1, pf) == 1;
+		ok &= fread(&m_maxZ, sizeof(float), 1, pf) == 1;
+		ok &= fread(&m_resolution, sizeof(float), 1, pf) == 1;
+		ok &= fread(&numPoints, sizeof(int), 1, pf) == 1;
+		if(!ok || m_resolution <= 0 || numPoints < 0 || !readGridData(pf, version))
+		{
+			std::cout << "Error reading grid bundle " << fileName << std::endl;
+			fclose(pf);
+			return false;
+		}
+		m_oneDivRes = 1.0/m_resolution;
+		setGridBounds();
+		printMapInfo();
+
+		// Read the occupied voxels of the map
+		m_cloud->width = numPoints;
+		m_cloud->height = 1;
+		m_cloud->points.resize(numPoints);
+		for(int i=0; i<numPoints && ok; i++)
+			ok = fread(m_cloud->points[i].data, sizeof(float), 3, pf) == 3;
+		fclose(pf);
+		if(!ok)
+		{
+			std::cout << "Error reading grid bundle " << fileName << std::endl;
+			delete []m_grid;
+			m_grid = NULL;
+			return false;
+		}
+		setupPointCloud();
+		
+		return true;
+	}
+
+	//! Read grid sizes, sensor deviation and cells (version 0 for legacy grid files)
+	bool readGridData(FILE *pf, int version)
+	{
+		bool ok = true;
+		int encoding = GRID_ENCODING_RAW;
+		if(version >= 3)
+			ok &= fread(&m_gridSize, sizeof(int64_t), 1, pf) == 1;
+		else
+		{
+			int size;
+			ok &= fread(&size, sizeof(int), 1, pf) == 1;
+			m_gridSize = size;
+		}
+		ok &= fread(&m_gridSizeX, sizeof(int), 1, pf) == 1;
+		ok &= fread(&m_gridSizeY, sizeof(int), 1, pf) == 1;
+		ok &= fread(&m_gridSizeZ, sizeof(int), 1, pf) == 1;
+		ok &= fread(&m_sensorDev, sizeof(float), 1, pf) == 1;
+		if(version >= 2)
+			ok &= fread(&encoding, sizeof(int), 1, pf) == 1;
+		if(!ok || m_gridSize != (int64_t)m_gridSizeX*m_gridSizeY*m_gridSizeZ)
+			return false;
+		setGridSteps();
+		
+		// Read grid cells
+		if(m_grid != NULL)
+			delete []m_grid;
+		m_grid = new gridCell[m_gridSize];
+		if(encoding == GRID_ENCODING_DELTA)
+			ok = readDeltaCells(pf);
+		else if(encoding == GRID_ENCODING_RAW)
+			ok = fread(m_grid, sizeof(gridCell), m_gridSize, pf) == (size_t)m_gridSize;
+		else
+			ok = false;
+		if(!ok)
+		{
+			delete []m_grid;
+			m_grid = NULL;
+			return false;
+		}
+
+		return true;
+	}
+
+	// Rays traced together by castRayPacket
+	static const int RAY_PACKET = 8;
+
+	//! Sphere tracing of up to RAY_PACKET rays in lockstep. The distance field bounds the free step,
+	//! the lanes are updated without branches so that the loop can be vectorized
+	void castRayPacket(float x, float y, float z, const float *dx, const float *dy, const float *dz, int n, 
+					   float maxRange, float *ranges)
+	{
+		float t[RAY_PACKET], range[RAY_PACKET], rdx[RAY_PACKET], rdy[RAY_PACKET], rdz[RAY_PACKET];
+		int active[RAY_PACKET];
+		for(int l=0; l<RAY_PACKET; l++)
+		{
+			int k = std::min(l, n-1);
+			rdx[l] = dx[k]; rdy[l] = dy[k]; rdz[l] = dz[k];
+			t[l] = 0.0;
+			range[l] = -1.0;
+			active[l] = l < n;
+		}
+
+		// The closest grid sample is no further than 0.87 voxels from the point
+		float hitDist = 1.4*m_resolution, margin = 0.9*m_resolution, minStep = 0.5*m_resolution;
+		int maxSteps = (int)(maxRange/minStep) + 1;
+		for(int step=0; step<maxSteps; step++)
+		{
+			int any = 0;
+			for(int l=0; l<RAY_PACKET; l++)
+			{
+				float px = x + t[l]*rdx[l], py = y + t[l]*rdy[l], pz = z + t[l]*rdz[l];
+				int in = active[l] && t[l] < maxRange && px >= 0.0f && py >= 0.0f && pz >= 0.0f && px < m_maxX && py < m_maxY && pz < m_maxZ;
+				int64_t ix = std::min((int)(px*m_oneDivRes + 0.5f), m_gridSizeX-1);
+				int64_t iy = std::min((int)(py*m_oneDivRes + 0.5f), m_gridSizeY-1);
+				int64_t iz = std::min((int)(pz*m_oneDivRes + 0.5f), m_gridSizeZ-1);
+				float d2 = m_grid[in ? ix + iy*m_gridStepY + iz*m_gridStepZ : 0].dist;
+				float d = sqrtf(std::max(d2, 0.0f));  // The grid stores squared distances
+				int valid = in && d2 >= 0.0f;
+				int hit = valid && d < hitDist;
+				range[l] = hit ? t[l] : range[l];
+				active[l] = valid && !hit;
+				t[l] += active[l] ? std::max(d - margin, minStep) : 0.0f;
+				any |= active[l];
+			}
+			if(!any)
+				break;
+		}
+		for(int l=0; l<n; l++)
+			ranges[l] = range[l];
+	}
+
+	//! Run f(i) for i in [0,n) distributed among the available cores
+	template<typename F>
+	static void parallelFor(int n, F f)
+	{
+		int numThreads = std::max(1, std::min(n, (int)std::thread::hardware_concurrency()));
+		std::vector<std::thread> threads;
+		for(int t=0; t<numThreads; t++)
+			threads.push_back(std::thread([=]() { for(int i=t; i<n; i+=numThreads) f(i); }));
+		for(int t=0; t<numThreads; t++)
+			threads[t].join();
+	}
+
+	//! Append v as zigzag varint
+	static void pushVarint(std::vector<uint8_t> &buf, int64_t v)
+	{
+		uint64_t u = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+		while(u >= 0x80)
+		{
+			buf.push_back((uint8_t)(u | 0x80));
+			u >>= 7;
+		}
+		buf.push_back((uint8_t)u);
+	}
+
+	//! Read a zigzag varint, returns false on buffer overrun
+	static bool popVarint(const uint8_t *&p, const uint8_t *end, int64_t &v)
+	{
+		uint64_t u = 0;
+		for(int shift=0; p < end && shift < 64; shift+=7)
+		{
+			uint8_t b = *p++;
+			u |= (uint64_t)(b & 0x7f) << shift;
+			if(!(b & 0x80))
+			{
+				v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	//! Encode the distances of a XY slice. Distances are quantized and coded as the error of a
+	//! linear prediction along X (second order delta), which is tiny for smooth distance fields.
+	//! Probabilities are not stored, they are recomputed from the distance when loading
+	void encodeSlice(int iz, std::vector<uint8_t> &buf)
+	{
+		const gridCell *slice = m_grid + iz*m_gridStepZ;
+		float oneDivQ = 1.0/m_gridQuantization;
+		int64_t q0 = 0, q1 = 0, q2 = 0;
+		for(int iy=0; iy<m_gridSizeY; iy++)
+		{
+			const gridCell *row = slice + iy*m_gridStepY;
+			for(int ix=0; ix<m_gridSizeX; ix++)
+			{
+				int64_t q = (int64_t)llround(row[ix].dist*oneDivQ);
+				int64_t pred = (ix == 0) ? q0 : (ix == 1) ? q1 : 2*q1-q2;
+				pushVarint(buf, q-pred);
+				if(ix == 0)
+					q0 = q;
+				q2 = q1;
+				q1 = q;
+			}
+		}
+	}
+
+	//! Decode a XY slice coded by encodeSlice 
+	bool decodeSlice(int iz, const uint8_t *p, const uint8_t *end)
+	{
+		gridCell *slice = m_grid + iz*m_gridStepZ;
+		float gaussConst1 = 1./(m_sensorDev*sqrt(2*M_PI));
+		float gaussConst2 = 1./(2*m_sensorDev*m_sensorDev);
+		int64_t q0 = 0, q1 = 0, q2 = 0, d;
+		for(int iy=0; iy<m_gridSizeY; iy++)
+		{
+			gridCell *row = slice + iy*m_gridStepY;
+			for(int ix=0; ix<m_gridSizeX; ix++)
+			{
+				if(!popVarint(p, end, d))
+					return false;
+				int64_t q = d + ((ix == 0) ? q0 : (ix == 1) ? q1 : 2*q1-q2);
+				if(ix == 0)
+					q0 = q;
+				q2 = q1;
+				q1 = q;
+				float dist = q*m_gridQuantization;
+				row[ix].dist = dist;
+				row[ix].prob = dist < 0 ? 0.0 : gaussConst1*exp(-dist*dist*gaussConst2);
+			}
+		}
+
+		return p == end;
+	}
+
+	//! Write the grid as delta coded slices, with an index of slice sizes for parallel decoding
+	void writeDeltaCells(FILE *pf)
+	{
+		std::vector< std::vector<uint8_t> > chunks(m_gridSizeZ);
+		parallelFor(m_gridSizeZ, [&](int iz) { encodeSlice(iz, chunks[iz]); });
+
+		std::vector<uint64_t> index(m_gridSizeZ);
+		for(int iz=0; iz<m_gridSizeZ; iz++)
+			index[iz] = chunks[iz].size();
+		fwrite(&m_gridQuantization, sizeof(float), 1, pf);
+		fwrite(index.data(), sizeof(uint64_t), m_gridSizeZ, pf);
+		for(int iz=0; iz<m_gridSizeZ; iz++)
+			fwrite(chunks[iz].data(), 1, chunks[iz].size(), pf);
+	}
+
+	//! Read and decode in parallel the slices written by writeDeltaCells
+	bool readDeltaCells(FILE *pf)
+	{
+		std::vector<uint64_t> index(m_gridSizeZ), offset(m_gridSizeZ+1, 0);
+		if(fread(&m_gridQuantization, sizeof(float), 1, pf) != 1 ||
+		   fread(index.data(), sizeof(uint64_t), m_gridSizeZ, pf) != (size_t)m_gridSizeZ)
+			return false;
+		for(int iz=0; iz<m_gridSizeZ; iz++)
+			offset[iz+1] = offset[iz] + index[iz];
+
+		// Single read of the compressed data, then decode each slice in parallel
+		std::vector<uint8_t> data(offset[m_gridSizeZ]);
+		if(fread(data.data(), 1, data.size(), pf) != data.size())
+			return false;
+		std::vector<char> valid(m_gridSizeZ);
+		parallelFor(m_gridSizeZ, [&](int iz) 
+		{ 
+			valid[iz] = decodeSlice(iz, data.data()+offset[iz], data.data()+offset[iz+1]); 
+		});
+
+		return std::find(valid.begin(), valid.end(), 0) == valid.end();
+	}
 	
 	void computePointCloud(void)
 	{
@@ -591,6 +1318,11 @@ protected:
 		m_cloud->width = i;
 		m_cloud->points.resize(i);
 		
+		setupPointCloud();
+	}
+
+	void setupPointCloud(void)
+	{
 		// Create the point cloud msg for publication
 		pcl::toROSMsg(*m_cloud, m_pcMsg);
 		m_pcMsg.header.frame_id = m_globalFrameId;
@@ -601,34 +1333,32 @@ protected:
 	
 	void computeGrid(void)
 	{
-		//Publish percent variable
-		std_msgs::Float32 percent_msg;
-		percent_msg.data = 0;
 		// Alloc the 3D grid
 		m_gridSizeX = (int)(m_maxX*m_oneDivRes);
 		m_gridSizeY = (int)(m_maxY*m_oneDivRes); 
 		m_gridSizeZ = (int)(m_maxZ*m_oneDivRes);
-		m_gridSize = m_gridSizeX*m_gridSizeY*m_gridSizeZ;
-		m_gridStepY = m_gridSizeX;
-		m_gridStepZ = m_gridSizeX*m_gridSizeY;
+		m_gridSize = (int64_t)m_gridSizeX*m_gridSizeY*m_gridSizeZ;
+		setGridSteps();
+		setGridBounds();
+		if(m_grid != NULL)
+			delete []m_grid;
 		m_grid = new gridCell[m_gridSize];
 
 		// Setup kdtree
 		m_kdtree.setInputCloud(m_cloud);
 
-		// Compute the distance to the closest point of the grid
-		int index;
-		float dist;
+		// Compute the distance to the closest point of the grid, one XY slice per task
 		float gaussConst1 = 1./(m_sensorDev*sqrt(2*M_PI));
 		float gaussConst2 = 1./(2*m_sensorDev*m_sensorDev);
-		pcl::PointXYZ searchPoint;
-		std::vector<int> pointIdxNKNSearch(1);
-		std::vector<float> pointNKNSquaredDistance(1);
-		double count=0;
-		double percent;
-		double size=m_gridSizeX*m_gridSizeY*m_gridSizeZ;
-		for(int iz=0; iz<m_gridSizeZ; iz++)
+		float maxDist = m_gridTruncation > 0 ? m_gridTruncation*m_gridTruncation : -1.0;
+		std::atomic<int> count(0);
+		parallelFor(m_gridSizeZ, [&](int iz)
 		{
+			int64_t index;
+			float dist;
+			pcl::PointXYZ searchPoint;
+			std::vector<int> pointIdxNKNSearch(1);
+			std::vector<float> pointNKNSquaredDistance(1);
 			for(int iy=0; iy<m_gridSizeY; iy++)
 			{
 				for(int ix=0; ix<m_gridSizeX; ix++)
@@ -637,13 +1367,12 @@ protected:
 					searchPoint.y = iy*m_resolution;
 					searchPoint.z = iz*m_resolution;
 					index = ix + iy*m_gridStepY + iz*m_gridStepZ;
-					++count;
-					percent = count/size *100.0;
-					ROS_INFO_THROTTLE(0.5,"Progress: %lf %%", percent);	
 					
 					if(m_kdtree.nearestKSearch(searchPoint, 1, pointIdxNKNSearch, pointNKNSquaredDistance) > 0)
 					{
 						dist = pointNKNSquaredDistance[0];
+						if(maxDist > 0 && dist > maxDist)
+							dist = maxDist;
 						m_grid[index].dist = dist;
 						m_grid[index].prob = gaussConst1*exp(-dist*dist*gaussConst2);
 					}
@@ -652,10 +1381,10 @@ protected:
 						m_grid[index].dist = -1.0;
 						m_grid[index].prob =  0.0;
 					}
-
 				}
 			}
-		}
+			ROS_INFO_THROTTLE(0.5,"Progress: %lf %%", 100.0*(++count)/m_gridSizeZ);	
+		});
 	}
 	
 	void buildGridSliceMsg(float z)
@@ -677,27 +1406,56 @@ protected:
 		m_gridSliceMsg.info.origin.orientation.y = 0.0;
 		m_gridSliceMsg.info.origin.orientation.z = 0.0;
 		m_gridSliceMsg.info.origin.orientation.w = 1.0;
-		m_gridSliceMsg.data.resize(m_gridSizeX*m_gridSizeY);
+		m_gridSliceMsg.data.resize(m_gridStepZ);
 
-		// Extract max probability
-		int offset = (int)(z*m_oneDivRes)*m_gridSizeX*m_gridSizeY;
-		int end = offset + m_gridSizeX*m_gridSizeY;
+		// Extract the probabilities of the slice and their max
+		std::vector<float> prob(m_gridStepZ);
+		float zc = ((int)(z*m_oneDivRes) + 0.5)*m_resolution;
 		float maxProb = -1.0;
-		for(int i=offset; i<end; i++)
-			if(m_grid[i].prob > maxProb)
-				maxProb = m_grid[i].prob;
+		for(int iy=0; iy<m_gridSizeY; iy++)
+			for(int ix=0; ix<m_gridSizeX; ix++)
+				maxProb = std::max(maxProb, prob[ix + iy*m_gridStepY] = getGridProb((ix+0.5)*m_resolution, (iy+0.5)*m_resolution, zc));
 
 		// Copy data into grid msg and scale the probability to [0,100]
 		if(maxProb < 0.000001)
 			maxProb = 0.000001;
 		maxProb = 100.0/maxProb;
-		for(int i=0; i<m_gridSizeX*m_gridSizeY; i++)
-			m_gridSliceMsg.data[i] = (int8_t)(m_grid[i+offset].prob*maxProb);
+		for(int64_t i=0; i<m_gridStepZ; i++)
+			m_gridSliceMsg.data[i] = (int8_t)(prob[i]*maxProb);
 	}
 	
-	inline int point2grid(const float &x, const float &y, const float &z)
+	inline int64_t point2grid(const float &x, const float &y, const float &z)
+	{
+		if(m_index32)
+			return (int)(x*m_oneDivRes) + (int)(y*m_oneDivRes)*m_gridStepY32 + (int)(z*m_oneDivRes)*m_gridStepZ32;
+		return (int64_t)(x*m_oneDivRes) + (int64_t)(y*m_oneDivRes)*m_gridStepY + (int64_t)(z*m_oneDivRes)*m_gridStepZ;
+	}
+
+	//! Compute the grid steps from the grid size
+	void setGridSteps(void)
+	{
+		m_gridStepY = m_gridSizeX;
+		m_gridStepZ = (int64_t)m_gridSizeX*m_gridSizeY;
+		m_index32 = m_gridSize < INT32_MAX;
+		m_gridStepY32 = (int)m_gridStepY;
+		m_gridStepZ32 = (int)m_gridStepZ;
+	}
+
+	//! Shrink the map bounds to the voxels of the grid, so that every point inside them has a voxel
+	void setGridBounds(void)
+	{
+		m_maxX = clipBound(m_gridSizeX);
+		m_maxY = clipBound(m_gridSizeY);
+		m_maxZ = clipBound(m_gridSizeZ);
+	}
+
+	//! Largest bound whose points still index voxels below size
+	float clipBound(int size)
 	{
-		return (int)(x*m_oneDivRes) + (int)(y*m_oneDivRes)*m_gridStepY + (int)(z*m_oneDivRes)*m_gridStepZ;
+		float bound = size*m_resolution;
+		while(bound > 0 && (int)(bound*m_oneDivRes) >= size)
+			bound = nextafterf(bound, 0);
+		return bound;
 	}
 };
 
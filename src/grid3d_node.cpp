@@ -1,23 +1,194 @@
+
+
+
 #include <ros/ros.h>
 #include <string>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <stdlib.h>
 #include "grid3d.hpp"
 
-int main(int argc, char **argv)
+// Generation job passed along the pipeline stages
+struct GridJob
 {
-	ros::init(argc, argv, "grid3d_generator_node");  
-	
-	// Particle filter instance
-	std::string node_name = "grid3d_generator_node";
-	if(argc != 2){
-		ROS_ERROR("You should give the .bt path as the first argument");
-		exit(1);
+	std::string mapPath, gridPath;
+	Grid3d *grid;
+};
+
+// Blocking queue between two pipeline stages. A NULL grid marks the end of the jobs
+class JobQueue
+{
+public:
+	JobQueue(size_t capacity) : m_capacity(capacity)
+	{
 	}
-	std::string map_path = std::string(argv[1]);
-	Grid3d pf(node_name, map_path);
-  
-	return 0;
+
+	void push(const GridJob &job)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_notFull.wait(lock, [this]() { return m_queue.size() < m_capacity; });
+		m_queue.push(job);
+		m_notEmpty.notify_one();
+	}
+
+	GridJob pop(void)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_notEmpty.wait(lock, [this]() { return !m_queue.empty(); });
+		GridJob job = m_queue.front();
+		m_queue.pop();
+		m_notFull.notify_one();
+		return job;
+	}
+
+private:
+	size_t m_capacity;
+	std::queue<GridJob> m_queue;
+	std::mutex m_mutex;
+	std::condition_variable m_notFull, m_notEmpty;
+};
+
+void printUsage(void)
+{
+	std::cout << "Usage: grid3d_node_dll [options] map1.bt [map2.bt ...]" << std::endl;
+	std::cout << "Options:" << std::endl;
+	std::cout << "\t-o, --output PATH        Output directory, or .grid file if a single map is given (default: next to each map)" << std::endl;
+	std::cout << "\t--sensor-dev VALUE       Sensor standard deviation (default: sensor_dev param or 0.2)" << std::endl;
+	std::cout << "\t--resolution METERS      Distance field resolution (default: octomap resolution)" << std::endl;
+	std::cout << "\t--truncation METERS      Clamp distances beyond this value (default: disabled)" << std::endl;
+	std::cout << "\t--encoding raw|delta     Grid cells encoding (default: delta)" << std::endl;
+	std::cout << "\t--quantization VALUE     Distance quantization for delta encoding (default: 0.0001)" << std::endl;
+	std::cout << "\t--descriptors METERS     Also write place recognition descriptors sampled every METERS (.scd file next to the grid)" << std::endl;
+	std::cout << "\t--sensor-height METERS   Height of the sensor over the ground for the descriptors (default: 1.0)" << std::endl;
+	std::cout << "\t--max-range METERS       Sensor range for the descriptors (default: 40.0)" << std::endl;
+}
+
+std::string getOutputPath(std::string &mapPath, std::string &output, bool single)
+{
+	std::string name = mapPath.substr(mapPath.find_last_of('/')+1);
+	if(name.length() > 3 && (name.compare(name.length()-3, 3, ".bt") == 0 || name.compare(name.length()-3, 3, ".ot") == 0))
+		name = name.substr(0, name.length()-3);
+	name += ".grid";
+	if(output.empty())
+		return mapPath.substr(0, mapPath.find_last_of('/')+1)+name;
+	if(single && output.length() > 5 && output.compare(output.length()-5, 5, ".grid") == 0)
+		return output;
+	return output + (output[output.length()-1] == '/' ? "" : "/") + name;
 }
 
+int main(int argc, char **argv)
+{
+	ros::init(argc, argv, "grid3d_generator_node");
+
+	// Default options from the node params
+	double value;
+	ros::NodeHandle lnh("~");
+	float sensorDev = lnh.getParam("sensor_dev", value) ? (float)value : 0.2;
+	float resolution = -1.0;
+	float truncation = -1.0;
+	bool compression = true;
+	float quantization = 0.0001;
+	float descriptorStep = -1.0, sensorHeight = 1.0, maxRange = 40.0;
+	std::string output;
+	std::vector<std::string> maps;
 
+	// Parse command line
+	for(int i=1; i<argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i+1 < argc;
+		if((arg == "-o" || arg == "--output") && hasValue)
+			output = argv[++i];
+		else if(arg == "--sensor-dev" && hasValue)
+			sensorDev = atof(argv[++i]);
+		else if(arg == "--resolution" && hasValue)
+			resolution = atof(argv[++i]);
+		else if(arg == "--truncation" && hasValue)
+			truncation = atof(argv[++i]);
+		else if(arg == "--quantization" && hasValue)
+			quantization = atof(argv[++i]);
+		else if(arg == "--descriptors" && hasValue)
+			descriptorStep = atof(argv[++i]);
+		else if(arg == "--sensor-height" && hasValue)
+			sensorHeight = atof(argv[++i]);
+		else if(arg == "--max-range" && hasValue)
+			maxRange = atof(argv[++i]);
+		else if(arg == "--encoding" && hasValue)
+			compression = std::string(argv[++i]) != "raw";
+		else if(arg == "-h" || arg == "--help")
+		{
+			printUsage();
+			return 0;
+		}
+		else if(arg[0] == '-')
+		{
+			ROS_ERROR("Unknown option %s", arg.c_str());
+			printUsage();
+			exit(1);
+		}
+		else
+			maps.push_back(arg);
+	}
+	if(maps.empty()){
+		ROS_ERROR("You should give at least one .bt path as argument");
+		printUsage();
+		exit(1);
+	}
 
+	// Pipeline: octomap parsing -> distance transform -> encoding and writing, each stage
+	// works on a different map. Queues of one element bound the number of grids in memory
+	JobQueue loaded(1), computed(1);
+	std::atomic<int> failed(0);
+	std::thread loader([&]()
+	{
+		for(int i=0; i<maps.size(); i++)
+		{
+			GridJob job;
+			job.mapPath = maps[i];
+			job.gridPath = getOutputPath(maps[i], output, maps.size() == 1);
+			job.grid = new Grid3d(sensorDev, resolution, truncation, compression, quantization);
+			if(!job.grid->generateLoad(job.mapPath))
+			{
+				ROS_ERROR("Error loading map %s", job.mapPath.c_str());
+				delete job.grid;
+				failed++;
+				continue;
+			}
+			loaded.push(job);
+		}
+		loaded.push(GridJob{"", "", NULL});
+	});
+	std::thread transformer([&]()
+	{
+		for(GridJob job = loaded.pop(); job.grid != NULL; job = loaded.pop())
+		{
+			std::cout << "Computing 3D occupancy grid of " << job.mapPath << std::endl;
+			job.grid->generateGrid();
+			computed.push(job);
+		}
+		computed.push(GridJob{"", "", NULL});
+	});
+	for(GridJob job = computed.pop(); job.grid != NULL; job = computed.pop())
+	{
+		if(job.grid->generateSave(job.gridPath))
+			std::cout << "Grid map successfully saved on " << job.gridPath << std::endl;
+		else
+			failed++;
+		if(descriptorStep > 0)
+		{
+			std::string descPath = job.gridPath.substr(0, job.gridPath.length()-5) + ".scd";
+			if(job.grid->generateDescriptors(descPath, descriptorStep, sensorHeight, maxRange))
+				std::cout << "Place recognition descriptors successfully saved on " << descPath << std::endl;
+			else
+				failed++;
+		}
+		delete job.grid;
+	}
+	loader.join();
+	transformer.join();
 
+	return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,76 @@
+#ifndef __PLANARGRID3D_HPP__
+#define __PLANARGRID3D_HPP__
+
+#include <vector>
+#include <stdlib.h>
+#include "trilinear.hpp"
+
+// 2.5D version of the trilinear field for ground robots. Only the horizontal band of voxels
+// swept by the sensor is kept, stored column by column so that the few layers of each XY
+// column are contiguous. Voxels out of the band are not represented.
+class PlanarGrid3d
+{
+public:
+
+	PlanarGrid3d(void)
+	{
+		m_enabled = false;
+	}
+
+	//! Setup a band of numZ layers from layer minZ for a grid of sizeX x sizeY columns
+	void init(int sizeX, int sizeY, int minZ, int numZ)
+	{
+		m_sizeX = sizeX;
+		m_sizeY = sizeY;
+		m_minZ = minZ;
+		m_numZ = numZ;
+		m_cells.assign((size_t)sizeX*sizeY*numZ, TrilinearParams());
+		m_enabled = true;
+	}
+
+	bool isEnabled(void)
+	{
+		return m_enabled;
+	}
+
+	size_t getMemorySize(void)
+	{
+		return m_cells.size()*sizeof(TrilinearParams);
+	}
+
+	//! Copy the band of a row of columns. fetch(ix, iy, iz) returns the parameters of a voxel
+	//! of the global field. Different rows can be built in parallel
+	template<typename Fetch>
+	void buildRow(int iy, Fetch &fetch)
+	{
+		for(int ix=0; ix<m_sizeX; ix++)
+			for(int k=0; k<m_numZ; k++)
+				m_cells[index(ix, iy, m_minZ+k)] = fetch(ix, iy, m_minZ+k);
+	}
+
+	//! Parameters of the voxel if it is into the band, NULL otherwise
+	inline const TrilinearParams *get(int ix, int iy, int iz) const
+	{
+		if((unsigned)ix >= (unsigned)m_sizeX || (unsigned)iy >= (unsigned)m_sizeY || (unsigned)(iz-m_minZ) >= (unsigned)m_numZ)
+			return NULL;
+		return &m_cells[index(ix, iy, iz)];
+	}
+
+protected:
+
+	inline size_t index(int ix, int iy, int iz) const
+	{
+		return ((size_t)ix + (size_t)iy*m_sizeX)*m_numZ + (iz-m_minZ);
+	}
+
+	bool m_enabled;
+	int m_sizeX, m_sizeY;
+
+	// Band layers
+	int m_minZ, m_numZ;
+
+	// Column major parameters
+	std::vector<TrilinearParams> m_cells;
+};
+
+#endif
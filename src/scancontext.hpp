@@ -0,0 +1,215 @@
+#ifndef __SCANCONTEXT_HPP__
+#define __SCANCONTEXT_HPP__
+
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <pcl/point_types.h>
+
+// Scan Context like global descriptor: the scan around the sensor is split in rings and
+// sectors, and each bin stores the maximum height of its points over the lowest point of
+// the scan. The ring occupancy is invariant to the yaw and is used as search key, while
+// the column shift that best aligns two descriptors gives their relative yaw.
+class ScanContext
+{
+public:
+
+	static const int NUM_RINGS = 20;
+	static const int NUM_SECTORS = 60;
+	static const int SIZE = NUM_RINGS*NUM_SECTORS;
+
+	// Descriptor of a pose of the map
+	struct Entry
+	{
+		float x, y, z;
+		float key[NUM_RINGS];
+		float desc[SIZE];
+	};
+
+	// Candidate pose of a query
+	struct Candidate
+	{
+		float x, y, z, yaw;
+		float dist;
+	};
+
+	ScanContext(float maxRange = 40.0) : m_maxRange(maxRange)
+	{
+	}
+
+	float getMaxRange(void)
+	{
+		return m_maxRange;
+	}
+
+	size_t size(void)
+	{
+		return m_entries.size();
+	}
+
+	//! Descriptor of the points given relative to the sensor, with the yaw of the map frame
+	void compute(const std::vector<pcl::PointXYZ> &points, float *key, float *desc)
+	{
+		float minZ = 0;
+		bool first = true;
+		for(size_t i=0; i<points.size(); i++)
+		{
+			const pcl::PointXYZ &p = points[i];
+			if(p.x*p.x + p.y*p.y < m_maxRange*m_maxRange && (first || p.z < minZ))
+			{
+				minZ = p.z;
+				first = false;
+			}
+		}
+		memset(desc, 0, SIZE*sizeof(float));
+		for(size_t i=0; i<points.size(); i++)
+		{
+			const pcl::PointXYZ &p = points[i];
+			float r = sqrt(p.x*p.x + p.y*p.y);
+			if(r >= m_maxRange)
+				continue;
+			int ring = std::min((int)(r*NUM_RINGS/m_maxRange), NUM_RINGS-1);
+			int sector = std::min((int)((atan2(p.y, p.x) + M_PI)*NUM_SECTORS/(2*M_PI)), NUM_SECTORS-1);
+			float &bin = desc[ring*NUM_SECTORS + sector];
+			bin = std::max(bin, p.z - minZ + 1e-3f);  // Non-empty bins are never zero
+		}
+		for(int ring=0; ring<NUM_RINGS; ring++)
+		{
+			int n = 0;
+			for(int sector=0; sector<NUM_SECTORS; sector++)
+				n += desc[ring*NUM_SECTORS + sector] > 0;
+			key[ring] = (float)n/NUM_SECTORS;
+		}
+	}
+
+	void add(const Entry &e)
+	{
+		m_entries.push_back(e);
+	}
+
+	//! Best k poses of the database for the descriptor: the entries with the closest ring keys
+	//! are compared at every column shift, the best shift gives the yaw
+	void query(const float *key, const float *desc, int k, std::vector<Candidate> &candidates)
+	{
+		// Pre-selection by ring key
+		int numKeys = std::min((int)m_entries.size(), 5*k);
+		std::vector< std::pair<float, int> > keys(m_entries.size());
+		for(size_t i=0; i<m_entries.size(); i++)
+		{
+			float d = 0;
+			for(int ring=0; ring<NUM_RINGS; ring++)
+				d += (key[ring]-m_entries[i].key[ring])*(key[ring]-m_entries[i].key[ring]);
+			keys[i] = std::make_pair(d, (int)i);
+		}
+		std::partial_sort(keys.begin(), keys.begin()+numKeys, keys.end());
+
+		// Full descriptor distance
+		candidates.clear();
+		for(int i=0; i<numKeys; i++)
+		{
+			const Entry &e = m_entries[keys[i].second];
+			int shift;
+			Candidate c;
+			c.dist = distance(desc, e.desc, shift);
+			c.x = e.x;
+			c.y = e.y;
+			c.z = e.z;
+			c.yaw = -shift*2*M_PI/NUM_SECTORS;
+			candidates.push_back(c);
+		}
+		std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) { return a.dist < b.dist; });
+		if((int)candidates.size() > k)
+			candidates.resize(k);
+	}
+
+	//! Mean cosine distance between the non-empty sectors at the best shift of the query columns
+	static float distance(const float *query, const float *desc, int &bestShift)
+	{
+		float best = 2.0;
+		bestShift = 0;
+		for(int shift=0; shift<NUM_SECTORS; shift++)
+		{
+			float sum = 0;
+			int n = 0;
+			for(int sector=0; sector<NUM_SECTORS; sector++)
+			{
+				int qs = (sector + shift) % NUM_SECTORS;
+				float dot = 0, nq = 0, nd = 0;
+				for(int ring=0; ring<NUM_RINGS; ring++)
+				{
+					float a = query[ring*NUM_SECTORS + qs], b = desc[ring*NUM_SECTORS + sector];
+					dot += a*b;
+					nq += a*a;
+					nd += b*b;
+				}
+				if(nq > 0 && nd > 0)
+				{
+					sum += 1.0 - dot/sqrt(nq*nd);
+					n++;
+				}
+			}
+			if(n > 0 && sum/n < best)
+			{
+				best = sum/n;
+				bestShift = shift;
+			}
+		}
+
+		return best;
+	}
+
+	bool save(std::string &path)
+	{
+		FILE *pf = fopen(path.c_str(), "wb");
+		if(pf == NULL)
+			return false;
+		uint32_t n = m_entries.size();
+		int32_t rings = NUM_RINGS, sectors = NUM_SECTORS;
+		bool ok = fwrite("DLLD", 1, 4, pf) == 4;
+		ok &= fwrite(&rings, sizeof(int32_t), 1, pf) == 1;
+		ok &= fwrite(&sectors, sizeof(int32_t), 1, pf) == 1;
+		ok &= fwrite(&m_maxRange, sizeof(float), 1, pf) == 1;
+		ok &= fwrite(&n, sizeof(uint32_t), 1, pf) == 1;
+		if(n > 0)
+			ok &= fwrite(&m_entries[0], sizeof(Entry), n, pf) == n;
+		fclose(pf);
+
+		return ok;
+	}
+
+	bool load(std::string &path)
+	{
+		FILE *pf = fopen(path.c_str(), "rb");
+		if(pf == NULL)
+			return false;
+		char magic[4];
+		uint32_t n = 0;
+		int32_t rings = 0, sectors = 0;
+		bool ok = fread(magic, 1, 4, pf) == 4 && memcmp(magic, "DLLD", 4) == 0;
+		ok = ok && fread(&rings, sizeof(int32_t), 1, pf) == 1 && rings == NUM_RINGS;
+		ok = ok && fread(&sectors, sizeof(int32_t), 1, pf) == 1 && sectors == NUM_SECTORS;
+		ok = ok && fread(&m_maxRange, sizeof(float), 1, pf) == 1;
+		ok = ok && fread(&n, sizeof(uint32_t), 1, pf) == 1;
+		if(ok)
+		{
+			m_entries.resize(n);
+			ok = n == 0 || fread(&m_entries[0], sizeof(Entry), n, pf) == n;
+		}
+		fclose(pf);
+		if(!ok)
+			m_entries.clear();
+
+		return ok;
+	}
+
+protected:
+
+	float m_maxRange;
+	std::vector<Entry> m_entries;
+};
+
+#endif
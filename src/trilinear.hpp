@@ -0,0 +1,44 @@
+#ifndef __TRILINEAR_HPP__
+#define __TRILINEAR_HPP__
+
+struct TrilinearParams
+{
+	float a0, a1, a2, a3, a4, a5, a6, a7;
+
+	TrilinearParams(void)
+	{
+		a0 = a1 = a2 = a3 = a4 = a5 = a6 = a7 = 0.0;
+	}
+
+	double interpolate(double x, double y, double z)
+	{
+		return a0 + a1*x + a2*y + a3*z + a4*x*y + a5*x*z + a6*y*z + a7*x*y*z;
+	}
+
+	//! Compute the parameters of the cell [x0,x1]x[y0,y1]x[z0,z1] from its corner values cXYZ
+	//! 见https://en.wikipedia.org/wiki/Trilinear_interpolation
+	void compute(double c000, double c001, double c010, double c011, 
+				 double c100, double c101, double c110, double c111,
+				 double x0, double y0, double z0, double x1, double y1, double z1)
+	{
+		double div = -1.0/((x1-x0)*(y1-y0)*(z1-z0));
+		a0 = (-c000*x1*y1*z1 + c001*x1*y1*z0 + c010*x1*y0*z1 - c011*x1*y0*z0 
+		+ c100*x0*y1*z1 - c101*x0*y1*z0 - c110*x0*y0*z1 + c111*x0*y0*z0)*div;
+		a1 = (c000*y1*z1 - c001*y1*z0 - c010*y0*z1 + c011*y0*z0
+		- c100*y1*z1 + c101*y1*z0 + c110*y0*z1 - c111*y0*z0)*div;
+		a2 = (c000*x1*z1 - c001*x1*z0 - c010*x1*z1 + c011*x1*z0 
+		- c100*x0*z1 + c101*x0*z0 + c110*x0*z1 - c111*x0*z0)*div;
+		a3 = (c000*x1*y1 - c001*x1*y1 - c010*x1*y0 + c011*x1*y0 
+		- c100*x0*y1 + c101*x0*y1 + c110*x0*y0 - c111*x0*y0)*div;
+		a4 = (-c000*z1 + c001*z0 + c010*z1 - c011*z0 + c100*z1 
+		- c101*z0 - c110*z1 + c111*z0)*div;
+		a5 = (-c000*y1 + c001*y1 + c010*y0 - c011*y0 + c100*y1 
+		- c101*y1 - c110*y0 + c111*y0)*div;
+		a6 = (-c000*x1 + c001*x1 + c010*x1 - c011*x1 + c100*x0 
+		- c101*x0 - c110*x0 + c111*x0)*div;
+		a7 = (c000 - c001 - c010 + c011 - c100
+		+ c101 + c110 - c111)*div;
+	}
+};
+
+#endif